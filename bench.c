@@ -0,0 +1,150 @@
+/*
+ * CS s165 A1
+ * Throughput benchmark for one node size configuration (put/get/range).
+ * Built once per configuration by "make sweep". "make tlbbench" runs it
+ * for every node memory mode and reports data TLB misses as well.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Node sizes in bytes are turned into compile-time capacities (same
+ * formulas as leafCapacityFor/nodeCapacityFor in btree.h). */
+#ifdef LEAF_BYTES
+#define LEAF_CAPACITY (LEAF_BYTES / 8 - 2 < 2 ? 2 : LEAF_BYTES / 8 - 2)
+#endif
+#ifdef COMPACT_REFS
+#define REF_BYTES 4
+#else
+#define REF_BYTES 8
+#endif
+#ifdef NODE_BYTES
+#define NODE_CAPACITY ((NODE_BYTES - 8 - 3 * REF_BYTES) / (4 + REF_BYTES) < 2 \
+    ? 2 : (NODE_BYTES - 8 - 3 * REF_BYTES) / (4 + REF_BYTES))
+#endif
+
+#include "btree.h"
+
+double now() {
+/** Wall clock in seconds.*/
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + t.tv_usec * 1e-6;
+}
+
+int openTlbCounter() {
+/** Counter of data TLB read misses of this thread (user space only).
+  * Returns: its file descriptor, -1 if the host doesn't expose it
+  * (VMs, perf_event_paranoid).
+  */
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+double tlbPerOp(int fd, long long *last, int ops) {
+/** Misses per operation since the previous call (-1 = no counter).*/
+    long long count;
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    double perOp = (double)(count - *last) / ops;
+    *last = count;
+    return perOp;
+}
+
+int main(int argc, char *argv[])
+{
+  // number of keys (puts and gets), range scans return ~1000 values
+  int nKeys = (argc > 1) ? atoi(argv[1]) : 1000000;
+  int nScans = 2000;
+  int leafBytes = (argc > 2) ? atoi(argv[2]) : 4096;
+  int nodeBytes = (argc > 3) ? atoi(argv[3]) : 4096;
+  // node memory: 'h' = huge pages, 'n' = NUMA interleave, '-' = calloc
+  char *mem = (argc > 4) ? argv[4] : "-";
+#ifdef LEAF_BYTES
+  leafBytes = LEAF_BYTES;
+#endif
+#ifdef NODE_BYTES
+  nodeBytes = NODE_BYTES;
+#endif
+
+  setNodeMemory((strchr(mem, 'h') ? NODEMEM_HUGE : 0) |
+      (strchr(mem, 'n') ? NODEMEM_INTERLEAVE : 0));
+  NodePtr rootPtr = createTree(
+      leafCapacityFor(leafBytes), nodeCapacityFor(nodeBytes), 0);
+  int *keys = malloc(nKeys * sizeof(int));
+  int i;
+  long sum = 0;
+
+  srand(165);
+  for (i = 0; i < nKeys; ++i) {
+    keys[i] = rand() - rand();
+    if (keys[i] == 0)
+      keys[i] = 1;
+  }
+
+  int tlbFd = openTlbCounter();
+  long long tlbCount = 0;
+  tlbPerOp(tlbFd, &tlbCount, 1);
+
+  double t = now();
+  for (i = 0; i < nKeys; ++i)
+    rootPtr = insert(rootPtr, keys[i], keys[i]);
+  double put = nKeys / (now() - t) / 1e6;
+  double putTlb = tlbPerOp(tlbFd, &tlbCount, nKeys);
+
+  t = now();
+  for (i = nKeys - 1; i >= 0; --i)
+    sum += find(rootPtr, keys[i]);
+  double get = nKeys / (now() - t) / 1e6;
+  double getTlb = tlbPerOp(tlbFd, &tlbCount, nKeys);
+
+  // key span holding ~1000 values
+  int span = (int)(1000.0 * 2 * RAND_MAX / nKeys);
+  long scanned = 0;
+  t = now();
+  for (i = 0; i < nScans; ++i) {
+    int *ptr = range(rootPtr, keys[i], keys[i] + span);
+    int *p = ptr;
+    while (p && *p) {
+      sum += *p;
+      ++scanned;
+      ++p;
+    }
+    free(ptr);
+  }
+  double scan = scanned / (now() - t) / 1e6;
+
+  // results are consumed so lookups can't be optimized away
+  volatile long sink = sum;
+  (void) sink;
+
+  // score = geometric mean of the three throughputs (Mops/s), TLB
+  // misses per put/get come after it ("make sweep" sorts on the score)
+  printf("leafBytes=%d leafCap=%d nodeBytes=%d nodeCap=%d "
+         "put=%.3f get=%.3f range=%.3f score=%.3f "
+         "mem=%s putTlbMiss=%.3f getTlbMiss=%.3f\n",
+         leafBytes, rootPtr->tree->leafCapacity,
+         nodeBytes, rootPtr->tree->nodeCapacity,
+         put, get, scan, cbrt(put * get * scan),
+         mem, putTlb, getTlb);
+  if (tlbFd >= 0)
+    close(tlbFd);
+
+  freeTree(rootPtr);
+  free(keys);
+  return 0;
+}
@@ -7,7 +7,12 @@
 #define BTREE_H
 #include "data_types.h"
 #include "query.h"
+#include "cache.h"
+#include "hashindex.h"
+#include "nodemem.h"
+#include "taskpool.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,52 +26,208 @@
  * - "d" = order of tree = node capacity.
  * - EXCEPTION: root capacity is 1 <= m <= 2d.
  * - Number of children: 2d + 1.
+ * - Leaves (keys + values) and internal nodes (keys + children) have
+ *   their own capacity. Both are kept in the tree descriptor shared by
+ *   all nodes (with the write buffer size, the read cache and the hash
+ *   index), so nodes only carry what their own type needs.
  */
 
+/**
+ * Compile-time capacities. Building with -DLEAF_CAPACITY=<n> and/or
+ * -DNODE_CAPACITY=<n> fixes the capacity of every leaf/internal node,
+ * so the search loops get constant bounds and are unrolled/vectorized.
+ * 0 = capacities are chosen at run time ("createTree").
+ */
+#ifndef LEAF_CAPACITY
+#define LEAF_CAPACITY 0
+#endif
+#ifndef NODE_CAPACITY
+#define NODE_CAPACITY 0
+#endif
+
+/**
+ * NODE REFERENCES:
+ * - Default: children, parent and sisters are plain pointers.
+ * - Building with -DCOMPACT_REFS ("make COMPACT_REFS=1") keeps every node
+ *   in an indexed node pool and links nodes with 32-bit ids: child arrays
+ *   take half the bytes (more children per internal node) and links stay
+ *   valid wherever the pool is mapped.
+ * - REF(ptr) and DEREF(ref) convert between both. Id 0 is NULL, so
+ *   zero-terminated children arrays work the same in both modes.
+ */
+#ifdef COMPACT_REFS
+typedef unsigned int NodeRef;
+#define REF(ptr) ((ptr) ? (ptr)->id : 0)
+#define DEREF(ref) nodeAt(ref)
+#else
+typedef struct nodeClass * NodeRef;
+#define REF(ptr) (ptr)
+#define DEREF(ref) (ref)
+#endif
+
+struct treeClass {
+    /*capacities of leaves and internal nodes*/
+    int leafCapacity, nodeCapacity;
+    /*write buffer size of internal nodes (0 = no buffers)*/
+    int bufferCapacity;
+    /*hot-key read cache (NULL = disabled)*/
+    struct cacheClass *cache;
+    /*hash index of every key (NULL = disabled)*/
+    struct hashIndexClass *index;
+};
+
+struct writeBufferClass {
+    /*pending messages and slots (2 * (bufferCapacity + 1))*/
+    int count, slots;
+    /*SORTED keys and their values (in the same block)*/
+    int *keys, *values;
+};
+
 struct nodeClass {
     /*MAX number of values to store*/
     int capacity;
     /*node or leaf*/
     char nodeType[5];
-    /*array of pointers*/
-    struct nodeClass** children;
-    /*pointer to parent Node*/
-    struct nodeClass* parentPtr;
-    /*pointer to left and right sisters (leafs)*/
-    struct nodeClass* leftSisterPtr;
-    struct nodeClass* rightSisterPtr;
+    /*parent Node. Links come before the pointers below so 32-bit ids
+      (COMPACT_REFS) pack with the fields above instead of being padded*/
+    NodeRef parentPtr;
+    /*left and right sisters (leafs)*/
+    NodeRef leftSisterPtr;
+    NodeRef rightSisterPtr;
+#ifdef COMPACT_REFS
+    /*index in the node pool*/
+    NodeRef id;
+#endif
+    /*array of children*/
+    NodeRef *children;
     /*key-values pairs to store*/
     int *keys, *values;
+    /*tree descriptor (shared by all nodes, owned by the ROOT)*/
+    struct treeClass *tree;
+    /*write buffer of pending upserts (internal nodes of write-buffered
+      trees only, NULL otherwise)*/
+    struct writeBufferClass *buffer;
 };
 
 /*definitions to resemble types/classes*/
 typedef struct nodeClass * NodePtr;
 typedef struct nodeClass Node;
+typedef struct treeClass * TreePtr;
+typedef struct treeClass Tree;
+typedef struct writeBufferClass * BufferPtr;
+typedef struct writeBufferClass WriteBuffer;
+
+/*merge operator of "update": new value from current value and operand*/
+typedef int (*MergeFn)(int current, int operand);
+
+#ifdef COMPACT_REFS
+/*nodes per pool chunk (chunks never move, so nodes don't either)*/
+#define POOL_CHUNK 4096
+
+struct nodePoolClass {
+    Node **chunks;
+    unsigned int nChunks, chunkSlots;
+    /*next never used id / first id of the list of released nodes*/
+    NodeRef next, freeList;
+    /*nodes in use*/
+    long live;
+    pthread_mutex_t lock;
+};
+
+/*single pool shared by all trees: ids are unique in the process*/
+static struct nodePoolClass nodePool = {
+    NULL, 0, 0, 1, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static inline NodePtr nodeAt(NodeRef id) {
+/** Node of pool id "id" (NULL for 0).*/
+    return id ? &nodePool.chunks[id / POOL_CHUNK][id % POOL_CHUNK] : NULL;
+}
+#endif
+
+/*bumped every time a node is released: remembered paths to nodes
+  (lookup hints) are only valid while it doesn't change*/
+static unsigned long nodeEpoch = 0;
 
 /**************** Prototypes ****************/
 
+/** Node Pool Functions*/
+NodePtr allocNode(void);
+void releaseNode(NodePtr p);
+void freeNodeArrays(NodePtr p);
+int freeNodePool(void);
+
 /** Main Functions*/
 NodePtr createNode(char type[], int capacity, NodePtr parentPointer);
+NodePtr createTreeNode(
+    char type[], int capacity, TreePtr tree, NodePtr parentPointer);
+NodePtr createLike(char type[], NodePtr model, NodePtr parentPointer);
+NodePtr createTree(int leafCapacity, int nodeCapacity, int bufferCapacity);
+TreePtr createTreeState(
+    int leafCapacity, int nodeCapacity, int bufferCapacity);
+void freeTreeState(TreePtr t);
+int leafCapacityFor(int bytes);
+int nodeCapacityFor(int bytes);
+int bufferedNodeCapacity(int nodeCapacity, int *bufferCapacity);
+int leafSearch(NodePtr leaf, int k);
 NodePtr insert(NodePtr nPtr, int k, int v);
+NodePtr insertAtLeaf(NodePtr nPtr, int k, int v);
 NodePtr getNextChild(NodePtr p, int k);
+int childSlot(NodePtr p, int k);
 NodePtr splitLeaf(NodePtr nPtr);
 NodePtr splitNode(NodePtr node);
 NodePtr traverseTreeBottomUp(NodePtr node);
-void addKeyAndChildren(int *kPtr, NodePtr *childPtr, NodePtr lPtr, NodePtr rPtr);
+NodePtr replaceRoot(NodePtr oldRoot, NodePtr newRoot);
+void addKeyAndChildren(int *kPtr, NodeRef *childPtr, NodePtr lPtr, NodePtr rPtr);
 void distributeKV(NodePtr sourcePtr, NodePtr lLeaf, NodePtr rLeaf);
 void addKV(int *kPtr, int *vPtr, int k, int v, int addValue);
 void pointToParent(NodePtr topNode);
 
+/** Write Buffer Functions*/
+BufferPtr createBuffer(int bufferCapacity);
+void freeBuffer(BufferPtr b);
+int bufferCount(NodePtr n);
+int bufferSearch(NodePtr n, int k);
+void bufferPut(NodePtr n, int k, int v);
+int bufferGet(NodePtr n, int k, int *v);
+void bufferSplit(NodePtr source, NodePtr lNode, NodePtr rNode, int k);
+int busiestChild(NodePtr n, int *from, int *to);
+int mergeIntoLeaf(NodePtr leaf, int *mKeys, int *mValues, int n, int upper);
+NodePtr flushBuffer(NodePtr node);
+int countBuffered(NodePtr n);
+
+/** Update Functions*/
+int mergeAdd(int current, int operand);
+int mergeMin(int current, int operand);
+int mergeMax(int current, int operand);
+int mergeOr(int current, int operand);
+MergeFn mergeOperator(char op);
+NodePtr update(NodePtr rootPtr, int k, char op, int operand);
+NodePtr updateWith(NodePtr rootPtr, int k, MergeFn fn, int operand);
+
+/** Hash Index Functions*/
+IndexPtr indexTree(NodePtr rootPtr, int entries);
+void indexBuffers(IndexPtr x, NodePtr n);
+
 /** Range Scan Functions*/
 NodePtr findLeaf(NodePtr nodePtr, int k);
 int countRangeVals(NodePtr leafPtr, int start, int end, int counter);
 void assignRangeValues(int *arrPtr, NodePtr startLeaf, int start, int end);
 int* range(NodePtr rootPtr, int start, int end);
+int* bufferedRange(NodePtr rootPtr, int start, int end);
+
+/** Parallel Functions*/
+NodePtr* collectSubtrees(NodePtr root, int bounded, int start, int end,
+    int target, int *n, NodePtr **upper, int *nUpper);
+NodePtr lastLeaf(NodePtr n);
+int* parallelRange(PoolPtr pool, NodePtr rootPtr, int start, int end);
+void parallelCountStats(
+    PoolPtr pool, NodePtr r, int* cNode, int* cLeaf, int* over, int* add);
+void parallelFreeTree(PoolPtr pool, NodePtr p);
 
 /** Helper Functions*/
 void clearAll(int *ptr);
 void copyArray(int start, int until, int *arrPtr, int *fromArr);
-void copyArrayChildren(int start, int until, NodePtr *arrPtr, NodePtr *fromArr);
+void copyArrayChildren(int start, int until, NodeRef *arrPtr, NodeRef *fromArr);
 void freeNode(NodePtr p);
 void freeTree(NodePtr p);
 int keyExists(int *intPtr, int len, int num);
@@ -76,80 +237,323 @@ int arrSize(int *ptr);
 int keysOverLimit(NodePtr p);
 
 /** Testing Functions*/
-int getChildrenNum(NodePtr *childPtr, int counter);
+int getChildrenNum(NodeRef *childPtr, int counter);
 void treeInfo(NodePtr root);
+void parallelTreeInfo(PoolPtr pool, NodePtr root);
 void printNodeKeys(int *ptr);
 void printTreeKeys(NodePtr topNode);
 void insertValues(NodePtr rootPtr, int min, int max, char mode);
 void countStats(NodePtr r, int* cNode, int* cLeaf, int* over, int* add);
 void testFind(NodePtr root, int k);
 void testRangeScan(NodePtr root, int start, int end);
+void testParallelRangeScan(PoolPtr pool, NodePtr root, int start, int end);
 
 
 /***************************************************************/
 /************************** FUNCTIONS **************************/
 /***************************************************************/
 
+/******************** NODE POOL ********************/
+
+NodePtr allocNode(void) {
+/** Return a zeroed node. With COMPACT_REFS it comes from the node pool
+  * (released nodes are reused first) and gets its id.
+  */
+#ifdef COMPACT_REFS
+    pthread_mutex_lock(&nodePool.lock);
+    NodeRef id = nodePool.freeList;
+    if (id)
+        nodePool.freeList = nodeAt(id)->parentPtr;
+    else {
+        id = nodePool.next++;
+        if (id / POOL_CHUNK == nodePool.nChunks) {
+            if (nodePool.nChunks == nodePool.chunkSlots) {
+                nodePool.chunkSlots = nodePool.chunkSlots ?
+                    2 * nodePool.chunkSlots : 64;
+                nodePool.chunks = realloc(nodePool.chunks,
+                    nodePool.chunkSlots * sizeof(Node *));
+            }
+            nodePool.chunks[nodePool.nChunks++] =
+                nodeAlloc(POOL_CHUNK * sizeof(Node));
+        }
+    }
+    NodePtr p = nodeAt(id);
+    memset(p, 0, sizeof(Node));
+    p->id = id;
+    ++nodePool.live;
+    pthread_mutex_unlock(&nodePool.lock);
+    return p;
+#else
+    return nodeAlloc(sizeof(Node));
+#endif
+}
+
+void releaseNode(NodePtr p) {
+/** Give the memory of a node back (its arrays must be freed already).
+  * Pool nodes are chained in the free list through "parentPtr".
+  */
+    __atomic_add_fetch(&nodeEpoch, 1, __ATOMIC_RELAXED);
+#ifdef COMPACT_REFS
+    pthread_mutex_lock(&nodePool.lock);
+    NodeRef id = p->id;
+    memset(p, 0, sizeof(Node));
+    p->id = id;
+    p->parentPtr = nodePool.freeList;
+    nodePool.freeList = id;
+    --nodePool.live;
+    pthread_mutex_unlock(&nodePool.lock);
+#else
+    nodeFree(p, sizeof(Node));
+#endif
+}
+
+void freeNodeArrays(NodePtr p) {
+/** Frees the keys, values, children and buffer arrays of a node. Their
+  * sizes follow from the type and capacity (see "createTreeNode").
+  */
+    int isNode = strEqual(p->nodeType, "node");
+    nodeFree(p->keys, (p->capacity + 2) * sizeof(int));
+    nodeFree(p->values, isNode ? 0 : (p->capacity + 2) * sizeof(int));
+    nodeFree(p->children, isNode ? (p->capacity + 3) * sizeof(NodeRef) : 0);
+    freeBuffer(p->buffer);
+}
+
+int freeNodePool(void) {
+/** Give the chunks of the node pool back, so the next nodes come from
+  * the current "setNodeMemory" mode (the first chunk is allocated with
+  * the first node). Only possible while no node is in use.
+  * Returns: 0 on success, -1 if nodes are still in use.
+  */
+#ifdef COMPACT_REFS
+    pthread_mutex_lock(&nodePool.lock);
+    if (nodePool.live) {
+        pthread_mutex_unlock(&nodePool.lock);
+        return -1;
+    }
+    unsigned int i;
+    for (i = 0; i < nodePool.nChunks; ++i)
+        nodeFree(nodePool.chunks[i], POOL_CHUNK * sizeof(Node));
+    free(nodePool.chunks);
+    nodePool.chunks = NULL;
+    nodePool.nChunks = nodePool.chunkSlots = 0;
+    nodePool.next = 1;
+    nodePool.freeList = 0;
+    pthread_mutex_unlock(&nodePool.lock);
+#endif
+    return 0;
+}
+
 /******************** MAIN FUNCTIONS ********************/
 
-NodePtr createNode(char type[4], int capacity, NodePtr parentPointer) {
+NodePtr createNode(char type[], int capacity, NodePtr parentPointer) {
 /** Creates an internal node or a leaf node. Keys and Values have
   * (CAPACITY + 1) since nodes are splitted only after capacity is
   * surpassed. Child array have (CAPACITY + 2) since the upper limit is
   * (CAPACITY + 1) + 1 extra child inserted when capacity is surpassed.
+  * The node joins the tree of its parent. Without a parent it is the
+  * ROOT of a new tree with "capacity" for leaves and internal nodes.
   * @param type "node" or "leaf".
   * @param capacity Max number of key-values.
   * @param parentPointer pointer to parent node.
   */
-    NodePtr newNodePtr = calloc(1, sizeof(Node));
-    newNodePtr->keys = calloc(capacity + 2, sizeof(int));
+    TreePtr tree = parentPointer ? parentPointer->tree :
+        createTreeState(capacity, capacity, 0);
+    return createTreeNode(type, capacity, tree, parentPointer);
+}
+
+NodePtr createTreeNode(
+    char type[], int capacity, TreePtr tree, NodePtr parentPointer) {
+/** Same as "createNode" for a node of "tree". Internal nodes get a
+  * write buffer when the tree has a "bufferCapacity".
+  */
+    // compile-time capacities win: search loops rely on them
+    if (strEqual(type, "node") && NODE_CAPACITY)
+        capacity = NODE_CAPACITY;
+    else if (!strEqual(type, "node") && LEAF_CAPACITY)
+        capacity = LEAF_CAPACITY;
+
+    NodePtr newNodePtr = allocNode();
+    newNodePtr->keys = nodeAlloc((capacity + 2) * sizeof(int));
     newNodePtr->capacity = capacity;
-    newNodePtr->parentPtr = parentPointer;
-    newNodePtr->leftSisterPtr = NULL;
-    newNodePtr->rightSisterPtr = NULL;
+    newNodePtr->tree = tree;
+    newNodePtr->parentPtr = REF(parentPointer);
 
     if (strEqual(type, "node")) {
         strcpy(newNodePtr->nodeType, "node\0");
-        newNodePtr->children = calloc(capacity + 3, sizeof(Node));
-        newNodePtr->values = calloc(0, sizeof(int));
+        newNodePtr->children = nodeAlloc((capacity + 3) * sizeof(NodeRef));
+        newNodePtr->values = nodeAlloc(0);
+        if (tree->bufferCapacity > 0)
+            newNodePtr->buffer = createBuffer(tree->bufferCapacity);
     }
     else {
         strcpy(newNodePtr->nodeType, "leaf\0");
-        newNodePtr->children = calloc(0, sizeof(Node));
-        newNodePtr->values = calloc(capacity + 2, sizeof(int));
+        newNodePtr->children = nodeAlloc(0);
+        newNodePtr->values = nodeAlloc((capacity + 2) * sizeof(int));
     }
 
     return newNodePtr;
 }
 
-int find(NodePtr nodePtr, int k) {
-/** Find value in leaf.*/
-    /*Helper function to navigate key and value arrays */
-    int getValue(int *kPtr, int *vPtr, int k) {
-        if (*kPtr == k)
-            return *vPtr;
-        else
-            return getValue(++kPtr, ++vPtr, k);
+NodePtr createLike(char type[], NodePtr model, NodePtr parentPointer) {
+/** Creates a node of "type" in the tree of "model", with the capacity
+  * of its type. Used when nodes are splitted.
+  */
+    TreePtr tree = model->tree;
+    int capacity = strEqual(type, "node") ?
+        tree->nodeCapacity : tree->leafCapacity;
+    return createTreeNode(type, capacity, tree, parentPointer);
+}
+
+NodePtr createTree(int leafCapacity, int nodeCapacity, int bufferCapacity) {
+/** Creates the ROOT (an empty leaf) of a new tree.
+  * @param leafCapacity Max number of key-values in leaves.
+  * @param nodeCapacity Max number of keys in internal nodes.
+  * @param bufferCapacity write buffer size (0 = no buffers). The buffer
+  * takes part of the bytes of internal nodes ("bufferedNodeCapacity").
+  */
+    TreePtr tree = createTreeState(leafCapacity, nodeCapacity, bufferCapacity);
+    return createTreeNode("leaf", tree->leafCapacity, tree, NULL);
+}
+
+TreePtr createTreeState(
+    int leafCapacity, int nodeCapacity, int bufferCapacity) {
+/** Creates the descriptor of a tree (see "createTree"). Compile-time
+  * capacities win over the ones given.
+  */
+    TreePtr t = calloc(1, sizeof(Tree));
+    t->bufferCapacity = bufferCapacity;
+    t->nodeCapacity = bufferedNodeCapacity(nodeCapacity, &t->bufferCapacity);
+    t->leafCapacity = LEAF_CAPACITY ? LEAF_CAPACITY : leafCapacity;
+    return t;
+}
+
+void freeTreeState(TreePtr t) {
+/** Frees a tree descriptor, its cache and its index.*/
+    if (t) {
+        freeCache(t->cache);
+        freeIndex(t->index);
+        free(t);
     }
+}
 
-    if (strEqual(nodePtr->nodeType, "node"))
-        return find(getNextChild(nodePtr, k), k);
+int leafCapacityFor(int bytes) {
+/** Leaf capacity filling "bytes" with keys and values (4B each).*/
+    int c = bytes / (2 * sizeof(int)) - 2;
+    return (c < 2) ? 2 : c;
+}
+
+int nodeCapacityFor(int bytes) {
+/** Internal node capacity filling "bytes" with keys (4B) and
+  * child references (8B, 4B with COMPACT_REFS).
+  */
+    // signed: "bytes" may not even hold the fixed part
+    int c = (bytes - (int)(2 * sizeof(int) + 3 * sizeof(NodeRef)))
+        / (int)(sizeof(int) + sizeof(NodeRef));
+    return (c < 2) ? 2 : c;
+}
+
+int bufferedNodeCapacity(int nodeCapacity, int *bufferCapacity) {
+/** Internal node capacity left once the write buffer takes its part of
+  * the bytes of a "nodeCapacity" node. The buffer has 2 * (bufferCapacity
+  * + 1) slots of 8B (key + value) and gets at most 3/4 of the bytes, so
+  * "bufferCapacity" is lowered if needed. Batches only pay off when the
+  * buffer is much larger than the fanout. A compile-time NODE_CAPACITY
+  * can't shrink: the buffer comes on top of it.
+  * Returns: the capacity (unchanged if "bufferCapacity" is 0).
+  */
+    if (NODE_CAPACITY)
+        nodeCapacity = NODE_CAPACITY;
+    if (*bufferCapacity <= 0)
+        return nodeCapacity;
+
+    int bytes = 2 * sizeof(int) + 3 * sizeof(NodeRef)
+        + nodeCapacity * (sizeof(int) + sizeof(NodeRef));
+    int maxSlots = bytes * 3 / 4 / (2 * sizeof(int));
+    if (2 * (*bufferCapacity + 1) > maxSlots)
+        *bufferCapacity = (maxSlots / 2 - 1 < 1) ? 1 : maxSlots / 2 - 1;
+    if (NODE_CAPACITY)
+        return NODE_CAPACITY;
+    return nodeCapacityFor(bytes - 2 * (*bufferCapacity + 1) * 2 * sizeof(int));
+}
+
+int leafSearch(NodePtr leaf, int k) {
+/** Return the index of k in a leaf (-1 if missing). With a
+  * compile-time LEAF_CAPACITY the scan is branch-free over every slot, a
+  * fixed-size vectorized loop. Otherwise it stops at the first key >= k
+  * (keys are SORTED and end at 0).
+  */
+    int *keys = leaf->keys;
+    int i, idx = -1;
+    if (!LEAF_CAPACITY) {
+        for (i = 0; keys[i] && keys[i] < k; ++i)
+            ;
+        return (keys[i] && keys[i] == k) ? i : -1;
+    }
+    for (i = 0; i < LEAF_CAPACITY + 1; ++i) {
+        if (keys[i] == k)
+            idx = i;
+    }
+    return idx;
+}
+
+int find(NodePtr nodePtr, int k) {
+/** Find value in leaf. If the tree has a hash index it answers alone
+  * (it holds every key). Else, if the tree has a cache it is checked
+  * first and filled with keys found in the tree.
+  */
+    int v = 0;
+    CachePtr cache = nodePtr->tree->cache;
+    if (nodePtr->tree->index)
+        return indexGet(nodePtr->tree->index, k, &v) ? v : 0;
+    if (cache && cacheGet(cache, k, &v))
+        return v;
+
+    // pending upserts are newer than anything below them
+    while (strEqual(nodePtr->nodeType, "node")) {
+        if (bufferCount(nodePtr) && bufferGet(nodePtr, k, &v))
+            break;
+        nodePtr = getNextChild(nodePtr, k);
+    }
     // When leaf is reached
-    else {
-        if (!keyExists(nodePtr->keys, nodePtr->capacity, k)) {
-            return 0;
-        }
-        else
-            return getValue(nodePtr->keys, nodePtr->values, k);
+    if (strEqual(nodePtr->nodeType, "leaf")) {
+        int i = leafSearch(nodePtr, k);
+        if (i >= 0)
+            v = nodePtr->values[i];
     }
+
+    if (cache && v)
+        cachePut(cache, k, v);
+    return v;
 }
 
 NodePtr insert(NodePtr nPtr, int k, int v) {
 /** Insert (key, value) in tree and rebalance it if needed.
+  * In write-buffered trees the pair is queued in the root buffer and
+  * only reaches a leaf when buffers are flushed.
   * @param nPtr the ROOT node of the tree.
   * @param k key.
   * @param v value.
   * Returns: the ROOT of the tree.
+  */
+    if (nPtr->tree->index)
+        indexPut(nPtr->tree->index, k, v);
+    if (nPtr->tree->cache)
+        cacheUpdate(nPtr->tree->cache, k, v);
+    if (nPtr->buffer && isRoot(nPtr)) {
+        // splits can interrupt flushes: make room (the ROOT stays in place)
+        while (nPtr->buffer->count == nPtr->buffer->slots)
+            flushBuffer(nPtr);
+        bufferPut(nPtr, k, v);
+        NodePtr root = flushBuffer(nPtr);
+        return root ? root : nPtr;
+    }
+    return insertAtLeaf(nPtr, k, v);
+}
+
+NodePtr insertAtLeaf(NodePtr nPtr, int k, int v) {
+/** Insert (key, value) straight into its leaf (write buffers are not
+  * used) and rebalance the tree if needed.
+  * Returns: the ROOT of the tree.
   */
     if (strEqual(nPtr->nodeType, "leaf")) {
         addKV(nPtr->keys, nPtr->values, k, v, 1);
@@ -163,7 +567,7 @@ NodePtr insert(NodePtr nPtr, int k, int v) {
     }
     /*IF NODE: traverse tree top-down recursively.*/
     else {
-        return insert(getNextChild(nPtr, k), k, v);
+        return insertAtLeaf(getNextChild(nPtr, k), k, v);
     }
     return nPtr;
 }
@@ -177,7 +581,7 @@ NodePtr traverseTreeBottomUp(NodePtr node) {
         return node;
     }
     else {
-        return traverseTreeBottomUp(node->parentPtr);
+        return traverseTreeBottomUp(DEREF(node->parentPtr));
     }
     return node;
 }
@@ -192,26 +596,29 @@ NodePtr splitLeaf(NodePtr nPtr) {
     /* IF leaf is root (parent == NULL)*/
     if (isRoot(nPtr)) {
         NodePtr parent = NULL;
-        p = createNode("node", nPtr->capacity, parent);
+        p = createLike("node", nPtr, parent);
     }
     /*IF leaf is NOT root*/
     else
-        p = nPtr->parentPtr;
+        p = DEREF(nPtr->parentPtr);
     // create 2 empty leafs
-    NodePtr lLeaf = createNode("leaf", nPtr->capacity, p);
-    NodePtr rLeaf = createNode("leaf", nPtr->capacity, p);
+    NodePtr lLeaf = createLike("leaf", nPtr, p);
+    NodePtr rLeaf = createLike("leaf", nPtr, p);
     distributeKV(nPtr, lLeaf, rLeaf);
     // insert key and children in parent node
     addKeyAndChildren(p->keys, p->children, lLeaf, rLeaf);
     // assign sister pointers
-    lLeaf->rightSisterPtr = rLeaf;
+    lLeaf->rightSisterPtr = REF(rLeaf);
     lLeaf->leftSisterPtr = nPtr->leftSisterPtr;
-    rLeaf->leftSisterPtr = lLeaf;
+    rLeaf->leftSisterPtr = REF(lLeaf);
     rLeaf->rightSisterPtr = nPtr->rightSisterPtr;
-    if (nPtr->leftSisterPtr != NULL)
-        (nPtr->leftSisterPtr)->rightSisterPtr = lLeaf;
-    if (nPtr->rightSisterPtr != NULL)
-        (nPtr->rightSisterPtr)->leftSisterPtr = rLeaf;
+    if (nPtr->leftSisterPtr)
+        DEREF(nPtr->leftSisterPtr)->rightSisterPtr = REF(lLeaf);
+    if (nPtr->rightSisterPtr)
+        DEREF(nPtr->rightSisterPtr)->leftSisterPtr = REF(rLeaf);
+    // a splitted root keeps its address: the new parent moves into it.
+    if (isRoot(nPtr))
+        return replaceRoot(nPtr, p);
     // original splitted leaf can be destroyed.
     freeNode(nPtr);
     return p;
@@ -222,13 +629,13 @@ NodePtr splitNode(NodePtr node) {
     NodePtr parent;
     if (isRoot(node)) {
         NodePtr p = NULL;
-        parent = createNode("node", node->capacity, p);
+        parent = createLike("node", node, p);
     }
     else
-        parent = node->parentPtr;
+        parent = DEREF(node->parentPtr);
     // create 2 empty nodes
-    NodePtr leftNode = createNode("node", node->capacity, parent);
-    NodePtr rightNode = createNode("node", node->capacity, parent);
+    NodePtr leftNode = createLike("node", node, parent);
+    NodePtr rightNode = createLike("node", node, parent);
     // determine lower and upper bounds (to be used as indexes)
     int lower = node->capacity/2;
     int upper = node->capacity+1;
@@ -238,6 +645,9 @@ NodePtr splitNode(NodePtr node) {
     // copy keys and child pointers to new right node
     copyArray(lower, upper, rightNode->keys, node->keys);
     copyArrayChildren(lower + 1, upper + 2, rightNode->children, node->children);
+    // pending upserts follow the children they belong to
+    if (bufferCount(node))
+        bufferSplit(node, leftNode, rightNode, node->keys[lower]);
     // inser key and children to the parent
     addKeyAndChildren(parent->keys, parent->children, leftNode, rightNode);
     // Clear all keys and assign them again starting at index [1] (lower + 1)
@@ -246,38 +656,75 @@ NodePtr splitNode(NodePtr node) {
     copyArray(lower + 1, upper, rightNode->keys, node->keys);
     // point children to parents recursively
     pointToParent(parent);
+    // a splitted root keeps its address: the new parent moves into it.
+    if (isRoot(node))
+        return replaceRoot(node, parent);
     // original splitted node can be destroyed
     freeNode(node);
     return parent;
 }
 
+NodePtr replaceRoot(NodePtr oldRoot, NodePtr newRoot) {
+/** Move the contents of "newRoot" into the memory of "oldRoot" so the
+  * ROOT pointer held by callers stays valid after the root is splitted.
+  * Its pool id stays with it.
+  * Returns: the (relocated) new root.
+  */
+#ifdef COMPACT_REFS
+    NodeRef id = oldRoot->id;
+#endif
+    freeNodeArrays(oldRoot);
+    *oldRoot = *newRoot;
+#ifdef COMPACT_REFS
+    oldRoot->id = id;
+#endif
+    releaseNode(newRoot);
+
+    NodeRef *p = oldRoot->children;
+    while (*p) {
+        DEREF(*p)->parentPtr = REF(oldRoot);
+        ++p;
+    }
+    return oldRoot;
+}
+
 void pointToParent(NodePtr topNode) {
 /** Recursively navigate the tree top-down changing the parent
   * pointer to "topNode" (the appropriate parent) for every
   * children until reaching the leafs.
   */
-    NodePtr *p = topNode->children;
+    NodeRef *p = topNode->children;
     while (*p) {
-        (*p)->parentPtr = topNode;
-        if (strEqual((*p)->nodeType, "node"))
-            pointToParent(*p);
+        NodePtr child = DEREF(*p);
+        child->parentPtr = REF(topNode);
+        if (strEqual(child->nodeType, "node"))
+            pointToParent(child);
         ++p;
     }
 }
 
-NodePtr getNextChild(NodePtr p, int k) {
-/** Return requested node child at correct position.
-  * Position = [i] where "k" < keys[i].
+int childSlot(NodePtr p, int k) {
+/** Return the position of the child of "p" where "k" belongs.
+  * Position = [i] where "k" < keys[i], i.e. the number of keys <= k.
+  * With a compile-time NODE_CAPACITY it is counted branch-free over
+  * every slot (empty slots are 0), a fixed-size vectorized loop.
+  * Otherwise the scan stops at the first key > k.
   */
-    NodePtr getChildHelper(int *kPtr, NodePtr *nPtr) {
-        if (!*kPtr || k < *kPtr) {
-            return *nPtr;
-        }
-        else {
-            return getChildHelper(++kPtr, ++nPtr);
-        }
+    int *keys = p->keys;
+    int i, idx = 0;
+    if (!NODE_CAPACITY) {
+        while (keys[idx] && keys[idx] <= k)
+            ++idx;
+        return idx;
     }
-    return getChildHelper(p->keys, p->children);
+    for (i = 0; i < NODE_CAPACITY + 1; ++i)
+        idx += (keys[i] != 0) & (keys[i] <= k);
+    return idx;
+}
+
+NodePtr getNextChild(NodePtr p, int k) {
+/** Return requested node child at correct position (see "childSlot").*/
+    return DEREF(p->children[childSlot(p, k)]);
 }
 
 void addKV(int *kPtr, int *vPtr, int k, int v, int addValue) {
@@ -307,7 +754,7 @@ void addKV(int *kPtr, int *vPtr, int k, int v, int addValue) {
 }
 
 void addKeyAndChildren(
-    int *kPtr, NodePtr *childPtr, NodePtr lPtr, NodePtr rPtr) {
+    int *kPtr, NodeRef *childPtr, NodePtr lPtr, NodePtr rPtr) {
 /** Add a key and corresponding left and right leaf nodes.
   * @param *kPtr pointer of keys array in parent node.
   * @param *childPtr pointer of children array in parent node.
@@ -316,13 +763,13 @@ void addKeyAndChildren(
   */
     addKV(kPtr, kPtr, *(rPtr->keys), 0, 0);
 
-    void insertChild(NodePtr *nodeArray, NodePtr childPtr) {
-        if (!*nodeArray || (*nodeArray)->keys[0] == childPtr->keys[0])
-            *nodeArray = childPtr;
-        else if (childPtr->keys[0] < (*nodeArray)->keys[0]) {
-            NodePtr tNode = *nodeArray;
-            *nodeArray = childPtr;
-            return insertChild(++nodeArray, tNode);
+    void insertChild(NodeRef *nodeArray, NodePtr childPtr) {
+        NodePtr current = DEREF(*nodeArray);
+        if (!current || current->keys[0] == childPtr->keys[0])
+            *nodeArray = REF(childPtr);
+        else if (childPtr->keys[0] < current->keys[0]) {
+            *nodeArray = REF(childPtr);
+            return insertChild(++nodeArray, current);
         }
         else
             return insertChild(++nodeArray, childPtr);
@@ -349,6 +796,387 @@ void distributeKV(NodePtr sourcePtr, NodePtr lLeaf, NodePtr rLeaf) {
     }
 }
 
+/******************** WRITE BUFFERS ********************/
+
+/**
+ * WRITE BUFFER INFO (B-epsilon mode):
+ * ------------------------------------
+ * - Internal nodes keep a SORTED buffer of pending upserts (key, value).
+ * - A message in a node is newer than any message or leaf entry for the
+ *   same key below it, so reads stop at the first buffer that has it.
+ * - When a buffer holds more than "bufferCapacity" messages, the slice
+ *   going to the child with most messages is moved down in one batch.
+ * - Buffers have a fixed number of slots (2 * (bufferCapacity + 1)) and
+ *   are part of the node budget: internal nodes give up fanout for them
+ *   ("bufferedNodeCapacity"). A batch is cut to the free slots of the
+ *   child it goes to.
+ * - A buffer may stay over capacity after a split interrupts its flush.
+ *   It is drained before the next batch is moved into it.
+ */
+
+BufferPtr createBuffer(int bufferCapacity) {
+/** Creates an empty write buffer of 2 * (bufferCapacity + 1) slots. Keys
+  * and values follow the header in a single block of the node memory.
+  */
+    int slots = 2 * (bufferCapacity + 1);
+    BufferPtr b = nodeAlloc(sizeof(WriteBuffer) + 2 * slots * sizeof(int));
+    b->slots = slots;
+    b->keys = (int *)(b + 1);
+    b->values = b->keys + slots;
+    return b;
+}
+
+void freeBuffer(BufferPtr b) {
+/** Frees a write buffer (NULL is ignored).*/
+    if (b)
+        nodeFree(b, sizeof(WriteBuffer) + 2 * b->slots * sizeof(int));
+}
+
+int bufferCount(NodePtr n) {
+/** Returns: number of messages buffered in "n" (0 if it has no buffer).*/
+    return n->buffer ? n->buffer->count : 0;
+}
+
+int bufferSearch(NodePtr n, int k) {
+/** Return the index of the first buffered message with key >= k.*/
+    BufferPtr b = n->buffer;
+    int lo = 0, hi = b->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (b->keys[mid] < k)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void bufferPut(NodePtr n, int k, int v) {
+/** Add a message to the buffer keeping it SORTED. A message for an
+  * existing key replaces it. Callers make sure there is a free slot
+  * ("insert" flushes a full ROOT first and "flushBuffer" never moves
+  * more messages into a child than it has room for).
+  */
+    BufferPtr b = n->buffer;
+    int i = bufferSearch(n, k);
+    if (i < b->count && b->keys[i] == k) {
+        b->values[i] = v;
+        return;
+    }
+    memmove(b->keys + i + 1, b->keys + i, (b->count - i) * sizeof(int));
+    memmove(b->values + i + 1, b->values + i, (b->count - i) * sizeof(int));
+    b->keys[i] = k;
+    b->values[i] = v;
+    ++b->count;
+}
+
+int bufferGet(NodePtr n, int k, int *v) {
+/** Returns: 1 and the value in "v" if "k" is buffered in "n".*/
+    BufferPtr b = n->buffer;
+    int i = bufferSearch(n, k);
+    if (i < b->count && b->keys[i] == k) {
+        *v = b->values[i];
+        return 1;
+    }
+    return 0;
+}
+
+void bufferSplit(NodePtr source, NodePtr lNode, NodePtr rNode, int k) {
+/** Move messages of "source" with key < k to lNode, the rest to rNode.*/
+    BufferPtr b = source->buffer;
+    int i;
+    for (i = 0; i < b->count; ++i) {
+        NodePtr to = (b->keys[i] < k) ? lNode : rNode;
+        bufferPut(to, b->keys[i], b->values[i]);
+    }
+    b->count = 0;
+}
+
+int busiestChild(NodePtr n, int *from, int *to) {
+/** Return the index of the child receiving most buffered messages.
+  * Buffer and keys are both sorted so each child gets a contiguous
+  * slice [from: to) of the buffer.
+  */
+    BufferPtr b = n->buffer;
+    int nKeys = arrSize(n->keys);
+    int i = 0, j, best = 0;
+    *from = *to = 0;
+
+    for (j = 0; j <= nKeys; ++j) {
+        int sliceStart = i;
+        while (i < b->count && (j == nKeys || b->keys[i] < n->keys[j]))
+            ++i;
+        if (i - sliceStart > *to - *from) {
+            best = j;
+            *from = sliceStart;
+            *to = i;
+        }
+    }
+    return best;
+}
+
+int mergeIntoLeaf(NodePtr leaf, int *mKeys, int *mValues, int n, int upper) {
+/** Merge sorted messages into a leaf in one pass. Stops before the
+  * first key >= upper (0 = no bound) or when the leaf would go over
+  * (capacity + 1) keys, so it can still be splitted as usual.
+  * Returns: the number of messages merged.
+  */
+    int size = arrSize(leaf->keys);
+    int room = leaf->capacity + 1 - size;
+    int taken = 0, added = 0, i = 0;
+
+    // count messages to take and how many of them are new keys
+    while (taken < n && (!upper || mKeys[taken] < upper)) {
+        while (i < size && leaf->keys[i] < mKeys[taken])
+            ++i;
+        if (i >= size || leaf->keys[i] != mKeys[taken]) {
+            if (added == room)
+                break;
+            ++added;
+        }
+        ++taken;
+    }
+
+    // merge backwards in place
+    int w = size + added - 1, l = size - 1, m = taken - 1;
+    while (m >= 0) {
+        if (l >= 0 && leaf->keys[l] > mKeys[m]) {
+            leaf->keys[w] = leaf->keys[l];
+            leaf->values[w--] = leaf->values[l--];
+        }
+        else {
+            // equal keys: the message replaces the old value
+            if (l >= 0 && leaf->keys[l] == mKeys[m])
+                --l;
+            leaf->keys[w] = mKeys[m];
+            leaf->values[w--] = mValues[m--];
+        }
+    }
+    return taken;
+}
+
+NodePtr flushBuffer(NodePtr node) {
+/** Move batches of messages down until the buffer of "node" is back
+  * within capacity. Batches going to leaves are applied in place.
+  * Returns: the ROOT if nodes were splitted on the way (in which case
+  * "node" may not exist anymore), NULL otherwise.
+  */
+    BufferPtr b = node->buffer;
+    int bufferCapacity = node->tree->bufferCapacity;
+    while (b->count > bufferCapacity) {
+        int from, to, i;
+        int idx = busiestChild(node, &from, &to);
+        NodePtr child = DEREF(node->children[idx]);
+        NodePtr root = NULL;
+
+        if (strEqual(child->nodeType, "node")) {
+            // left over capacity by an interrupted flush: drain it first
+            BufferPtr cb = child->buffer;
+            if (cb->count > bufferCapacity) {
+                root = flushBuffer(child);
+                if (root)
+                    return root;
+                continue;
+            }
+            // the rest of the slice waits for the next batch
+            if (to - from > cb->slots - cb->count)
+                to = from + cb->slots - cb->count;
+        }
+        int n = to - from;
+
+        // take the batch out of the buffer
+        int *bKeys = malloc(n * sizeof(int));
+        int *bValues = malloc(n * sizeof(int));
+        memcpy(bKeys, b->keys + from, n * sizeof(int));
+        memcpy(bValues, b->values + from, n * sizeof(int));
+        memmove(b->keys + from, b->keys + to, (b->count - to) * sizeof(int));
+        memmove(b->values + from, b->values + to,
+            (b->count - to) * sizeof(int));
+        b->count -= n;
+
+        if (strEqual(child->nodeType, "node")) {
+            for (i = 0; i < n; ++i)
+                bufferPut(child, bKeys[i], bValues[i]);
+            root = flushBuffer(child);
+        }
+        else {
+            i = 0;
+            while (i < n && !root) {
+                // leaf of the next message and the first key of the next leaf
+                int j = 0;
+                while (node->keys[j] && bKeys[i] >= node->keys[j])
+                    ++j;
+                NodePtr leaf = DEREF(node->children[j]);
+                i += mergeIntoLeaf(leaf, bKeys + i, bValues + i, n - i,
+                    node->keys[j]);
+                if (keysOverLimit(leaf))
+                    splitLeaf(leaf);
+                // "node" is about to split: finish the batch from the root
+                if (keysOverLimit(node))
+                    root = traverseTreeBottomUp(node);
+            }
+            for (; i < n; ++i)
+                root = insertAtLeaf(root, bKeys[i], bValues[i]);
+        }
+        free(bKeys);
+        free(bValues);
+        if (root)
+            return root;
+    }
+    return NULL;
+}
+
+int countBuffered(NodePtr n) {
+/** Count messages pending in all write buffers.*/
+    if (strEqual(n->nodeType, "leaf"))
+        return 0;
+
+    int counter = bufferCount(n);
+    NodeRef *p = n->children;
+    while (*p) {
+        counter += countBuffered(DEREF(*p));
+        ++p;
+    }
+    return counter;
+}
+
+/******************** UPDATE ********************/
+
+int mergeAdd(int current, int operand) {
+/** Counter increment. The sum is computed in 64 bits and saturates at
+  * INT_MAX / INT_MIN instead of overflowing.
+  */
+    long long sum = (long long)current + operand;
+    return (sum > INT_MAX) ? INT_MAX : (sum < INT_MIN) ? INT_MIN : (int)sum;
+}
+
+int mergeMin(int current, int operand) {
+/** Keep the smallest value.*/
+    return (operand < current) ? operand : current;
+}
+
+int mergeMax(int current, int operand) {
+/** Keep the largest value.*/
+    return (operand > current) ? operand : current;
+}
+
+int mergeOr(int current, int operand) {
+/** Set bits.*/
+    return current | operand;
+}
+
+MergeFn mergeOperator(char op) {
+/** Built-in merge operator for the DSL symbol: '+' add, '<' min,
+  * '>' max, '|' bitwise or. Returns NULL for unknown symbols.
+  */
+    switch (op) {
+        case '+': return mergeAdd;
+        case '<': return mergeMin;
+        case '>': return mergeMax;
+        case '|': return mergeOr;
+        default: return NULL;
+    }
+}
+
+NodePtr update(NodePtr rootPtr, int k, char op, int operand) {
+/** Read-modify-write "k" with a built-in merge operator.
+  * See "mergeOperator" and "updateWith".
+  */
+    MergeFn fn = mergeOperator(op);
+    if (!fn) {
+        perror("update: unknown merge operator.");
+        return rootPtr;
+    }
+    return updateWith(rootPtr, k, fn, operand);
+}
+
+NodePtr updateWith(NodePtr rootPtr, int k, MergeFn fn, int operand) {
+/** Read-modify-write "k" in a single descent: value = fn(value, operand).
+  * If "k" doesn't exist, (k, operand) is inserted.
+  * Value 0 means "no value" in the store ("find" returns 0 for missing
+  * keys and range results end at 0), so a merge that yields 0 stores 0:
+  * the key then reads as missing, like a put of 0, and the next update
+  * merges into 0 ('+' counts up from 0 again).
+  * A pending upsert in a write buffer is the newest value of "k", so it
+  * is merged in place there.
+  * @param rootPtr the ROOT node of the tree.
+  * @param fn merge operator.
+  * Returns: the ROOT of the tree.
+  */
+    NodePtr nPtr = rootPtr;
+    NodePtr root = rootPtr;
+    int v = operand;
+    int i;
+
+    while (strEqual(nPtr->nodeType, "node")) {
+        if (bufferCount(nPtr)) {
+            BufferPtr b = nPtr->buffer;
+            i = bufferSearch(nPtr, k);
+            if (i < b->count && b->keys[i] == k) {
+                v = b->values[i] = fn(b->values[i], operand);
+                break;
+            }
+        }
+        nPtr = getNextChild(nPtr, k);
+    }
+
+    if (strEqual(nPtr->nodeType, "leaf")) {
+        for (i = 0; nPtr->keys[i] && nPtr->keys[i] != k; ++i)
+            ;
+        if (nPtr->keys[i])
+            v = nPtr->values[i] = fn(nPtr->values[i], operand);
+        else
+            root = insertAtLeaf(nPtr, k, v);
+    }
+
+    if (rootPtr->tree->index)
+        indexPut(rootPtr->tree->index, k, v);
+    if (rootPtr->tree->cache)
+        cacheUpdate(rootPtr->tree->cache, k, v);
+    return root;
+}
+
+/******************** HASH INDEX ********************/
+
+IndexPtr indexTree(NodePtr rootPtr, int entries) {
+/** Build a hash index of every key in the tree and attach it to the
+  * tree ("find" uses it from then on). Leaves are indexed first, then
+  * the write buffers from the deepest up, so newer values win.
+  * @param entries expected number of keys (the index grows anyway).
+  * Returns: the index.
+  */
+    freeIndex(rootPtr->tree->index);
+    IndexPtr x = createIndex(entries);
+
+    NodePtr leaf = findLeaf(rootPtr, INT_MIN);
+    while (leaf) {
+        int *kPtr = leaf->keys;
+        int *vPtr = leaf->values;
+        while (*kPtr)
+            indexPut(x, *kPtr++, *vPtr++);
+        leaf = DEREF(leaf->rightSisterPtr);
+    }
+    indexBuffers(x, rootPtr);
+
+    rootPtr->tree->index = x;
+    return x;
+}
+
+void indexBuffers(IndexPtr x, NodePtr n) {
+/** Index the write buffers of a subtree, children before parents.*/
+    if (strEqual(n->nodeType, "leaf"))
+        return;
+
+    NodeRef *p = n->children;
+    while (*p) {
+        indexBuffers(x, DEREF(*p));
+        ++p;
+    }
+    int i;
+    for (i = 0; i < bufferCount(n); ++i)
+        indexPut(x, n->buffer->keys[i], n->buffer->values[i]);
+}
+
 /******************** RANGE SCAN ********************/
 
 NodePtr findLeaf(NodePtr nodePtr, int k) {
@@ -373,7 +1201,8 @@ int countRangeVals(NodePtr leafPtr, int start, int end, int counter) {
                 ++counter;
             ++ptr;
         }
-        return countRangeVals(leafPtr->rightSisterPtr, start, end, counter);
+        return countRangeVals(
+            DEREF(leafPtr->rightSisterPtr), start, end, counter);
     }
 }
 
@@ -387,7 +1216,7 @@ void assignRangeValues(int *arrPtr, NodePtr startLeaf, int start, int end) {
     int* kPtr = startLeaf->keys;
     int* vPtr = startLeaf->values;
     while (*kPtr) {
-        if (*kPtr == end)
+        if (*kPtr >= end)
             return;
         else if (*kPtr >= start) {
             *arrPtr = *vPtr;
@@ -396,7 +1225,8 @@ void assignRangeValues(int *arrPtr, NodePtr startLeaf, int start, int end) {
         ++kPtr;
         ++vPtr;
     }
-    return assignRangeValues(arrPtr, startLeaf->rightSisterPtr, start, end);
+    return assignRangeValues(
+        arrPtr, DEREF(startLeaf->rightSisterPtr), start, end);
 }
 
 int* range(NodePtr rootPtr, int start, int end) {
@@ -409,6 +1239,9 @@ int* range(NodePtr rootPtr, int start, int end) {
         start = temp;
     }
 
+    if (rootPtr->buffer)
+        return bufferedRange(rootPtr, start, end);
+
     int* arrPtr = NULL;
     int counter = 0;
 
@@ -421,11 +1254,354 @@ int* range(NodePtr rootPtr, int start, int end) {
     return arrPtr;
 }
 
+struct messageClass {
+    int key, value;
+    /*level of the buffer holding it (0 = root)*/
+    int depth;
+};
+
+typedef struct messageClass Message;
+
+int compareMessages(const void *l, const void *r) {
+/** Order messages by key, then newest (shallowest) first.*/
+    const Message *a = l, *b = r;
+    if (a->key != b->key)
+        return (a->key < b->key) ? -1 : 1;
+    return a->depth - b->depth;
+}
+
+int* bufferedRange(NodePtr rootPtr, int start, int end) {
+/** Same as "range" for write-buffered trees: pending messages in
+  * [start: end) are merged with the leaves. Buffered values win over
+  * leaf values and shallower buffers win over deeper ones.
+  */
+    int count = 0, cap = 64;
+    Message *msgs = malloc(cap * sizeof(Message));
+
+    void collect(NodePtr n, int depth) {
+        if (strEqual(n->nodeType, "leaf"))
+            return;
+        BufferPtr b = n->buffer;
+        int i;
+        for (i = bufferSearch(n, start);
+             i < b->count && b->keys[i] < end; ++i) {
+            if (count == cap) {
+                cap *= 2;
+                msgs = realloc(msgs, cap * sizeof(Message));
+            }
+            msgs[count].key = b->keys[i];
+            msgs[count].value = b->values[i];
+            msgs[count].depth = depth;
+            ++count;
+        }
+        // only children that can hold keys in [start: end)
+        int *k = n->keys;
+        NodeRef *c = n->children;
+        int j;
+        for (j = 0; c[j]; ++j) {
+            if (j > 0 && k[j - 1] >= end)
+                break;
+            if (c[j + 1] && k[j] <= start)
+                continue;
+            collect(DEREF(c[j]), depth + 1);
+        }
+    }
+    collect(rootPtr, 0);
+
+    // keep the newest message of every key
+    qsort(msgs, count, sizeof(Message), compareMessages);
+    int i, m = 0;
+    for (i = 0; i < count; ++i) {
+        if (m == 0 || msgs[m - 1].key != msgs[i].key)
+            msgs[m++] = msgs[i];
+    }
+
+    NodePtr leaf = findLeaf(rootPtr, start);
+    int counter = countRangeVals(leaf, start, end, 0);
+    int *arrPtr = calloc(counter + m + 1, sizeof(int));
+    int out = 0;
+    i = 0;
+
+    while (leaf) {
+        int *kPtr = leaf->keys;
+        int *vPtr = leaf->values;
+        while (*kPtr && *kPtr < end) {
+            if (*kPtr >= start) {
+                while (i < m && msgs[i].key < *kPtr)
+                    arrPtr[out++] = msgs[i++].value;
+                if (i < m && msgs[i].key == *kPtr)
+                    arrPtr[out++] = msgs[i++].value;
+                else
+                    arrPtr[out++] = *vPtr;
+            }
+            ++kPtr;
+            ++vPtr;
+        }
+        leaf = (*kPtr) ? NULL : DEREF(leaf->rightSisterPtr);
+    }
+    while (i < m)
+        arrPtr[out++] = msgs[i++].value;
+
+    free(msgs);
+    if (out == 0) {
+        free(arrPtr);
+        return NULL;
+    }
+    return arrPtr;
+}
+
+/******************** PARALLEL FUNCTIONS ********************/
+
+/*subtrees handed to the pool per worker (load balancing slack)*/
+#define SUBTREES_PER_THREAD 4
+
+struct rangeTaskClass {
+    /*first and last leaf of the subtree*/
+    NodePtr first, last;
+    int start, end;
+    /*values in range and where to write them*/
+    int count;
+    int *out;
+};
+
+struct statsTaskClass {
+    NodePtr subtree;
+    int cNode, cLeaf, over, add;
+};
+
+typedef struct rangeTaskClass RangeTask;
+typedef struct statsTaskClass StatsTask;
+
+NodePtr* collectSubtrees(NodePtr root, int bounded, int start, int end,
+    int target, int *n, NodePtr **upper, int *nUpper) {
+/** Split the tree at internal-node child boundaries, one level at a
+  * time, until there are at least "target" subtrees or the leaves are
+  * reached. Subtrees come out in key order.
+  * @param bounded IF 1 only subtrees overlapping [start: end) are kept.
+  * @param n returns the number of subtrees.
+  * @param upper (optional) returns the internal nodes above the subtrees.
+  * @param nUpper (optional) returns the size of "upper".
+  */
+    int count = 1, upCount = 0, upCap = 0;
+    NodePtr *level = calloc(1, sizeof(NodePtr));
+    NodePtr *up = NULL;
+    level[0] = root;
+
+    // no subtree overlaps an empty range
+    while (count > 0 && count < target &&
+        strEqual(level[0]->nodeType, "node")) {
+        int next = 0, i, j;
+        for (i = 0; i < count; ++i)
+            next += getChildrenNum(level[i]->children, 0);
+
+        NodePtr *children = calloc(next, sizeof(NodePtr));
+        if (upper && upCount + count > upCap) {
+            upCap = 2 * (upCount + count);
+            up = realloc(up, upCap * sizeof(NodePtr));
+        }
+
+        next = 0;
+        for (i = 0; i < count; ++i) {
+            int *k = level[i]->keys;
+            NodeRef *c = level[i]->children;
+            if (upper)
+                up[upCount++] = level[i];
+            // child [j] holds keys in [k[j - 1]: k[j])
+            for (j = 0; c[j]; ++j) {
+                if (bounded && j > 0 && k[j - 1] >= end)
+                    break;
+                if (bounded && c[j + 1] && k[j] <= start)
+                    continue;
+                children[next++] = DEREF(c[j]);
+            }
+        }
+        free(level);
+        level = children;
+        count = next;
+    }
+
+    *n = count;
+    if (upper) {
+        *upper = up;
+        *nUpper = upCount;
+    }
+    return level;
+}
+
+NodePtr lastLeaf(NodePtr n) {
+/** Return the rightmost leaf of the subtree.*/
+    if (strEqual(n->nodeType, "leaf"))
+        return n;
+    else
+        return lastLeaf(
+            DEREF(n->children[getChildrenNum(n->children, 0) - 1]));
+}
+
+void countRangeTask(void *arg) {
+/** Count values in range for the leaves of a single subtree.*/
+    RangeTask *t = arg;
+    NodePtr leaf = t->first;
+    t->count = 0;
+
+    while (leaf) {
+        int *kPtr = leaf->keys;
+        while (*kPtr) {
+            if (*kPtr >= t->end)
+                return;
+            else if (*kPtr >= t->start)
+                ++t->count;
+            ++kPtr;
+        }
+        leaf = (leaf == t->last) ? NULL : DEREF(leaf->rightSisterPtr);
+    }
+}
+
+void fillRangeTask(void *arg) {
+/** Copy values in range of a single subtree into its output region.*/
+    RangeTask *t = arg;
+    NodePtr leaf = t->first;
+    int *out = t->out;
+
+    while (leaf) {
+        int *kPtr = leaf->keys;
+        int *vPtr = leaf->values;
+        while (*kPtr) {
+            if (*kPtr >= t->end)
+                return;
+            else if (*kPtr >= t->start)
+                *out++ = *vPtr;
+            ++kPtr;
+            ++vPtr;
+        }
+        leaf = (leaf == t->last) ? NULL : DEREF(leaf->rightSisterPtr);
+    }
+}
+
+int* parallelRange(PoolPtr pool, NodePtr rootPtr, int start, int end) {
+/** Same as "range" but subtrees are scanned in parallel. Every subtree
+  * is counted first, so each task writes into its own pre-sized region
+  * of the result and no final sort or merge is needed.
+  * Falls back to "range" when there is no pool, the root is a leaf or
+  * the tree has write buffers.
+  */
+    if (!pool || strEqual(rootPtr->nodeType, "leaf") || rootPtr->buffer)
+        return range(rootPtr, start, end);
+
+    if (start > end) {
+        int temp = end;
+        end = start;
+        start = temp;
+    }
+    // [start: end) is empty
+    if (start == end)
+        return NULL;
+
+    int n, i, counter = 0;
+    int *arrPtr = NULL;
+    NodePtr *subtrees = collectSubtrees(rootPtr, 1, start, end,
+        pool->nThreads * SUBTREES_PER_THREAD, &n, NULL, NULL);
+    RangeTask *tasks = calloc(n, sizeof(RangeTask));
+
+    for (i = 0; i < n; ++i) {
+        tasks[i].first = findLeaf(subtrees[i], start);
+        tasks[i].last = lastLeaf(subtrees[i]);
+        tasks[i].start = start;
+        tasks[i].end = end;
+        poolSubmit(pool, countRangeTask, &tasks[i]);
+    }
+    poolWait(pool);
+
+    for (i = 0; i < n; ++i)
+        counter += tasks[i].count;
+
+    if (counter > 0) {
+        arrPtr = calloc(counter + 1, sizeof(int));
+        int offset = 0;
+        for (i = 0; i < n; ++i) {
+            tasks[i].out = arrPtr + offset;
+            offset += tasks[i].count;
+            if (tasks[i].count)
+                poolSubmit(pool, fillRangeTask, &tasks[i]);
+        }
+        poolWait(pool);
+    }
+
+    free(tasks);
+    free(subtrees);
+    return arrPtr;
+}
+
+void countStatsTask(void *arg) {
+/** Run "countStats" on a single subtree.*/
+    StatsTask *t = arg;
+    countStats(t->subtree, &t->cNode, &t->cLeaf, &t->over, &t->add);
+}
+
+void parallelCountStats(
+    PoolPtr pool, NodePtr r, int* cNode, int* cLeaf, int* over, int* add) {
+/** Same as "countStats" but subtrees are counted in parallel.*/
+    if (!pool || strEqual(r->nodeType, "leaf"))
+        return countStats(r, cNode, cLeaf, over, add);
+
+    int n, nUpper, i;
+    NodePtr *upper;
+    NodePtr *subtrees = collectSubtrees(r, 0, 0, 0,
+        pool->nThreads * SUBTREES_PER_THREAD, &n, &upper, &nUpper);
+    StatsTask *tasks = calloc(n, sizeof(StatsTask));
+
+    for (i = 0; i < n; ++i) {
+        tasks[i].subtree = subtrees[i];
+        poolSubmit(pool, countStatsTask, &tasks[i]);
+    }
+    // internal nodes above the subtrees are counted meanwhile
+    for (i = 0; i < nUpper; ++i) {
+        *cNode += 1;
+        if (keysOverLimit(upper[i]))
+            *over += 1;
+    }
+    poolWait(pool);
+
+    for (i = 0; i < n; ++i) {
+        *cNode += tasks[i].cNode;
+        *cLeaf += tasks[i].cLeaf;
+        *over += tasks[i].over;
+        *add += tasks[i].add;
+    }
+    free(tasks);
+    free(upper);
+    free(subtrees);
+}
+
+void freeTreeTask(void *arg) {
+/** Run "freeTree" on a single subtree.*/
+    freeTree(arg);
+}
+
+void parallelFreeTree(PoolPtr pool, NodePtr p) {
+/** Same as "freeTree" but subtrees are freed in parallel.*/
+    if (!pool || strEqual(p->nodeType, "leaf"))
+        return freeTree(p);
+
+    int n, nUpper, i;
+    NodePtr *upper;
+    NodePtr *subtrees = collectSubtrees(p, 0, 0, 0,
+        pool->nThreads * SUBTREES_PER_THREAD, &n, &upper, &nUpper);
+
+    for (i = 0; i < n; ++i)
+        poolSubmit(pool, freeTreeTask, subtrees[i]);
+    poolWait(pool);
+
+    for (i = 0; i < nUpper; ++i)
+        freeNode(upper[i]);
+    free(upper);
+    free(subtrees);
+}
+
 /******************** HELPER FUNCTIONS ********************/
 
 int isRoot(NodePtr n) {
 /** Check if node is root.*/
-    if (n->parentPtr == NULL)
+    if (!n->parentPtr)
         return 1;
     else
         return 0;
@@ -481,8 +1657,8 @@ void clearAll(int *ptr) {
 }
 
 void copyArrayChildren(
-    int start, int until, NodePtr *arrPtr, NodePtr *fromArr) {
-/** Copy values from one NodePtr array to another (as copyArray).*/
+    int start, int until, NodeRef *arrPtr, NodeRef *fromArr) {
+/** Copy values from one NodeRef array to another (as copyArray).*/
     if (start == until)
         return;
     else
@@ -502,12 +1678,14 @@ int keyExists(int *intPtr, int len, int num) {
 }
 
 void freeNode(NodePtr p) {
-/** Frees memory for node and all its contents.*/
+/** Frees memory for node and all its contents. The ROOT takes the
+  * tree descriptor with it.
+  */
     if (p) {
-        free(p->keys);
-        free(p->values);
-        free(p->children);
-        free(p);
+        if (isRoot(p))
+            freeTreeState(p->tree);
+        freeNodeArrays(p);
+        releaseNode(p);
         p = NULL;
     }
 }
@@ -517,9 +1695,9 @@ void freeTree(NodePtr p) {
     if (strEqual(p->nodeType, "leaf"))
         freeNode(p);
     else {
-        NodePtr* ptr = p->children;
+        NodeRef* ptr = p->children;
         while (*ptr) {
-            freeTree(*ptr);
+            freeTree(DEREF(*ptr));
             ++ptr;
         }
         freeNode(p);
@@ -583,15 +1761,15 @@ void printTreeKeys(NodePtr topNode) {
         printf("\nNODE--->");
         printNodeKeys(topNode->keys);
 
-        NodePtr *p = topNode->children;
+        NodeRef *p = topNode->children;
         while (*p) {
-            printTreeKeys(*p);
+            printTreeKeys(DEREF(*p));
             ++p;
         }
     }
 }
 
-int getChildrenNum(NodePtr *childPtr, int counter) {
+int getChildrenNum(NodeRef *childPtr, int counter) {
 /** Get number of children in single node.*/
     if (!*childPtr)
         return counter;
@@ -606,9 +1784,9 @@ void countStats(NodePtr r, int* cNode, int* cLeaf, int* over, int* add) {
     if (strEqual(r->nodeType, "node")) {
         *cNode += 1;
 
-        NodePtr* p = r->children;
+        NodeRef* p = r->children;
         while (*p) {
-            countStats(*p, cNode, cLeaf, over, add);
+            countStats(DEREF(*p), cNode, cLeaf, over, add);
             ++p;
         }
     }
@@ -623,11 +1801,18 @@ void countStats(NodePtr r, int* cNode, int* cLeaf, int* over, int* add) {
 
 void treeInfo(NodePtr root) {
 /** Print tree information.*/
+    parallelTreeInfo(NULL, root);
+}
+
+void parallelTreeInfo(PoolPtr pool, NodePtr root) {
+/** Print tree information. Nodes are counted in parallel if "pool"
+  * is not NULL.
+  */
     int getHight(NodePtr n, int counter) {
         if (strEqual(n->nodeType, "leaf"))
             return counter + 1;
         else
-            return getHight(n->children[0], counter + 1);
+            return getHight(DEREF(n->children[0]), counter + 1);
     }
 
     printf("\n==== TREE INFO: ====\n\n");
@@ -642,7 +1827,7 @@ void treeInfo(NodePtr root) {
     }
 
     int cNode = 0, cLeaf = 0, over = 0, add = 0;
-    countStats(root, &cNode, &cLeaf, &over, &add);
+    parallelCountStats(pool, root, &cNode, &cLeaf, &over, &add);
 
     printf("- Internal nodes: %d\n", cNode);
     printf("- Leaf nodes: %d\n", cLeaf);
@@ -652,7 +1837,39 @@ void treeInfo(NodePtr root) {
     float occ = (float)add/cLeaf;
     printf("- Avg. leaf occupancy: %.3f\n", occ);
 
-    printf("- Max capacity: %d\n", root->capacity);
+    printf("- Max capacity (leaf): %d\n", root->tree->leafCapacity);
+    printf("- Max capacity (node): %d\n", root->tree->nodeCapacity);
+
+    if (root->tree->bufferCapacity) {
+        printf("- Buffer capacity: %d\n", root->tree->bufferCapacity);
+        printf("- Buffered messages: %d\n", countBuffered(root));
+    }
+
+    if (root->tree->cache) {
+        CachePtr c = root->tree->cache;
+        long gets = c->hits + c->misses;
+        printf("- Cache entries: %u\n", (c->mask + 1) * CACHE_WAYS);
+        printf("- Cache hits: %ld (%.2f%%)\n", c->hits,
+            gets ? 100.0 * c->hits / gets : 0.0);
+        printf("- Cache misses: %ld\n", c->misses);
+        printf("- Cache evictions: %ld\n", c->evictions);
+    }
+
+    if (root->tree->index) {
+        IndexPtr x = root->tree->index;
+        printf("- Index keys: %ld (%u slots, %ld bytes)\n", x->count,
+            x->mask + 1, indexBytes(x));
+        printf("- Index hits: %ld, misses: %ld\n", x->hits, x->misses);
+    }
+
+    if (nodeMem.flags) {
+        printf("- Node memory: %ld of %ld bytes used, %ld regions\n",
+            nodeMem.usedBytes, nodeMem.mappedBytes, nodeMem.regions);
+        printf("- Huge pages: %ld regions MAP_HUGETLB, %ld THP\n",
+            nodeMem.hugeRegions, nodeMem.thpRegions);
+        printf("- NUMA: %ld regions interleaved over %d nodes\n",
+            nodeMem.interleaved, nodeMem.numaNodes);
+    }
 }
 
 void testFind(NodePtr root, int k) {
@@ -682,6 +1899,26 @@ void testRangeScan(NodePtr root, int start, int end) {
     }
 }
 
+void testParallelRangeScan(PoolPtr pool, NodePtr root, int start, int end) {
+/** Print an error message if the parallel scan doesn't match "range".*/
+    int* serial = range(root, start, end);
+    int* parallel = parallelRange(pool, root, start, end);
+    int i = 0;
+
+    if (!serial || !parallel) {
+        if (serial != parallel)
+            printf("PARALLEL SCAN: results don't match!\n");
+    }
+    else {
+        while (serial[i] && serial[i] == parallel[i])
+            ++i;
+        if (serial[i] != parallel[i])
+            printf("PARALLEL SCAN: results differ at index %d!\n", i);
+    }
+    free(serial);
+    free(parallel);
+}
+
 /**
 * Valgrind:
 * cd /home/antony/Desktop/workSpaceC &&\
@@ -0,0 +1,148 @@
+
+/*
+ * Hot-key read cache in front of "find"
+ */
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * CACHE INFO:
+ * ------------
+ * - Open-addressing table of key -> value split in buckets of one
+ *   cache line (64B) each: 7 keys, 7 values and 3 bytes of metadata.
+ *   A lookup hashes to one bucket and probes only that line.
+ * - Eviction is CLOCK inside the bucket: every slot has a reference bit
+ *   set on hits. The hand skips (and clears) referenced slots and
+ *   evicts the first one not referenced.
+ * - Only keys found in the tree are cached. Writers must call
+ *   "cacheUpdate" so cached values never go stale.
+ */
+
+#define CACHE_WAYS 7
+
+struct cacheBucketClass {
+    int keys[CACHE_WAYS];
+    int values[CACHE_WAYS];
+    /*bit i = slot i in use / slot i referenced since the hand passed*/
+    unsigned char used, ref;
+    /*CLOCK hand of the bucket*/
+    unsigned char hand;
+} __attribute__((aligned(64)));
+
+struct cacheClass {
+    struct cacheBucketClass *buckets;
+    /*number of buckets - 1 (power of 2)*/
+    unsigned int mask;
+    long hits, misses, evictions;
+};
+
+/*definitions to resemble types/classes*/
+typedef struct cacheBucketClass Bucket;
+typedef struct cacheClass * CachePtr;
+typedef struct cacheClass Cache;
+
+/**************** Prototypes ****************/
+
+CachePtr createCache(int entries);
+int cacheGet(CachePtr c, int k, int *v);
+void cachePut(CachePtr c, int k, int v);
+void cacheUpdate(CachePtr c, int k, int v);
+void freeCache(CachePtr c);
+
+/***************************************************************/
+/************************** FUNCTIONS **************************/
+/***************************************************************/
+
+CachePtr createCache(int entries) {
+/** Creates a cache with room for at least "entries" keys.*/
+    unsigned int nBuckets = 1;
+    while (nBuckets * CACHE_WAYS < (unsigned int)entries)
+        nBuckets *= 2;
+
+    CachePtr c = calloc(1, sizeof(Cache));
+    void *mem = NULL;
+    if (posix_memalign(&mem, 64, nBuckets * sizeof(Bucket)) != 0) {
+        free(c);
+        return NULL;
+    }
+    memset(mem, 0, nBuckets * sizeof(Bucket));
+    c->buckets = mem;
+    c->mask = nBuckets - 1;
+    return c;
+}
+
+Bucket *cacheBucket(CachePtr c, int k) {
+/** Return the bucket of key k (Fibonacci hashing).*/
+    unsigned int h = (unsigned int)k * 2654435769u;
+    return &c->buckets[(h ^ (h >> 15)) & c->mask];
+}
+
+int cacheSlot(Bucket *b, int k) {
+/** Return the slot holding key k in the bucket, -1 if not cached.*/
+    int i;
+    for (i = 0; i < CACHE_WAYS; ++i) {
+        if ((b->used >> i & 1) && b->keys[i] == k)
+            return i;
+    }
+    return -1;
+}
+
+int cacheGet(CachePtr c, int k, int *v) {
+/** Returns: 1 and the value in "v" if k is cached, 0 otherwise.*/
+    Bucket *b = cacheBucket(c, k);
+    int i = cacheSlot(b, k);
+    if (i < 0) {
+        ++c->misses;
+        return 0;
+    }
+    b->ref |= 1 << i;
+    *v = b->values[i];
+    ++c->hits;
+    return 1;
+}
+
+void cachePut(CachePtr c, int k, int v) {
+/** Cache (k, v), evicting a slot of the bucket with CLOCK if full.*/
+    Bucket *b = cacheBucket(c, k);
+    int i = cacheSlot(b, k);
+
+    if (i < 0 && b->used != (1 << CACHE_WAYS) - 1) {
+        i = 0;
+        while (b->used >> i & 1)
+            ++i;
+    }
+    else if (i < 0) {
+        while (b->ref >> b->hand & 1) {
+            b->ref &= ~(1 << b->hand);
+            b->hand = (b->hand + 1) % CACHE_WAYS;
+        }
+        i = b->hand;
+        b->hand = (b->hand + 1) % CACHE_WAYS;
+        ++c->evictions;
+    }
+    b->keys[i] = k;
+    b->values[i] = v;
+    b->used |= 1 << i;
+    b->ref &= ~(1 << i);
+}
+
+void cacheUpdate(CachePtr c, int k, int v) {
+/** Write-through for writers: refresh the value if k is cached.*/
+    Bucket *b = cacheBucket(c, k);
+    int i = cacheSlot(b, k);
+    if (i >= 0)
+        b->values[i] = v;
+}
+
+void freeCache(CachePtr c) {
+/** Frees all memory of the cache.*/
+    if (c) {
+        free(c->buckets);
+        free(c);
+    }
+}
+
+#endif
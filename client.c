@@ -0,0 +1,158 @@
+/*
+ * CS s165 A1
+ * Client of the server mode ("main -s <socket>"): sends the queries of a
+ * workload file and prints the replies the way "main -f" prints them, so
+ * both can be compared ("make check").
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*connection attempts while the server starts (10ms apart)*/
+#define CONNECT_TRIES 300
+
+int connectServer(char *socketPath) {
+/** Connect to the server, waiting for it to listen.
+  * Returns: the socket, -1 if it never came up.
+  */
+    struct sockaddr_un addr;
+    int i;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
+
+    for (i = 0; i < CONNECT_TRIES; ++i) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+            return fd;
+        close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+char *readFile(char *path, long *len) {
+/** Whole file in a 0-terminated buffer (NULL if it can't be read).*/
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    *len = ftell(fp);
+    rewind(fp);
+    char *buf = malloc(*len + 1);
+    *len = fread(buf, 1, *len, fp);
+    buf[*len] = '\0';
+    fclose(fp);
+    return buf;
+}
+
+char *exchange(int fd, char *queries, long len, long *outLen) {
+/** Send "queries" while reading the replies (the server stops reading
+  * while its replies are not read), until the server closes.
+  * Returns: the replies, NULL on error.
+  */
+    long sent = 0, cap = 65536;
+    char *out = malloc(cap);
+    *outLen = 0;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    while (1) {
+        struct pollfd p;
+        p.fd = fd;
+        p.events = POLLIN | (sent < len ? POLLOUT : 0);
+        if (poll(&p, 1, -1) < 0 && errno != EINTR)
+            break;
+        if (sent < len && (p.revents & POLLOUT)) {
+            ssize_t w = write(fd, queries + sent, len - sent);
+            if (w > 0)
+                sent += w;
+            if (sent == len)
+                shutdown(fd, SHUT_WR);
+        }
+        if (p.revents & (POLLIN | POLLHUP)) {
+            if (cap - *outLen < 65536) {
+                cap *= 2;
+                out = realloc(out, cap);
+            }
+            ssize_t r = read(fd, out + *outLen, cap - *outLen);
+            if (r == 0)
+                return out;
+            if (r > 0)
+                *outLen += r;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK)
+                break;
+        }
+        if (p.revents & POLLERR)
+            break;
+    }
+    free(out);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3) {
+      fprintf(stderr, "usage: %s <socket> <queries file> [stop]\n", argv[0]);
+      return 1;
+  }
+  long len, outLen;
+  char *queries = readFile(argv[2], &len);
+  int fd = connectServer(argv[1]);
+  if (!queries || fd < 0) {
+      perror("client: can't read the queries or reach the server.");
+      return 1;
+  }
+  // queries end with a newline, like file lines
+  if (len && queries[len - 1] != '\n') {
+      queries = realloc(queries, len + 2);
+      queries[len++] = '\n';
+      queries[len] = '\0';
+  }
+  char *replies = exchange(fd, queries, len, &outLen);
+  close(fd);
+  if (!replies) {
+      perror("client: connection lost.");
+      return 1;
+  }
+
+  // 'g' has one reply line, 'r' one line per value and an empty line
+  // (not printed by "main -f"), 'p' and 'u' have none
+  char *q = queries, *r = replies, *end = replies + outLen;
+  while (*q) {
+      char type = *q;
+      while (*q && *q++ != '\n')
+          ;
+      if (type != 'g' && type != 'r')
+          continue;
+      while (r < end) {
+          char *line = r;
+          while (r < end && *r != '\n')
+              ++r;
+          ++r;
+          if (type == 'r' && r - line == 1)
+              break;
+          fwrite(line, 1, r - line, stdout);
+          if (type == 'g')
+              break;
+      }
+  }
+
+  // stop the server once every reply is in
+  if (argc > 3 && !strcmp(argv[3], "stop") &&
+      (fd = connectServer(argv[1])) >= 0) {
+      if (write(fd, "q\n", 2) != 2)
+          perror("client: can't stop the server.");
+      close(fd);
+  }
+  free(queries);
+  free(replies);
+  return 0;
+}
@@ -0,0 +1,225 @@
+
+/*
+ * Online leaf compaction: repacks under-filled leaves in small slices
+ */
+#ifndef COMPACT_H
+#define COMPACT_H
+#include "btree.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * COMPACTION INFO:
+ * -----------------
+ * - Random inserts leave leaves ~2/3 full. The compactor walks the leaves
+ *   in key order and repacks runs of sister leaves with the same parent
+ *   into as few leaves as fit them at "fill" percent of the capacity.
+ *   Emptied leaves are freed and removed from the parent and sister chain.
+ * - Work is done in slices ("compactStep") of at most "budget" leaves, so
+ *   it can be interleaved with foreground puts/gets. Between slices only
+ *   the next key to visit is kept, so splits in between are harmless.
+ * - A full pass that frees nothing and sees no write marks the tree as
+ *   "settled": idle callers (the server) stop running slices until
+ *   "compactRearm" reports the next write.
+ * - Leaves under different parents are never merged (separators would
+ *   move between internal nodes). Internal nodes are not repacked: they
+ *   are ~1/capacity of the tree.
+ */
+
+/*queries run between two slices in file mode / idle wait of the server*/
+#define COMPACT_INTERVAL 1024
+#define COMPACT_IDLE_MS 10
+/*leaves visited per slice*/
+#define COMPACT_SLICE 64
+
+struct compactorClass {
+    /*target fill factor of repacked leaves (percent of capacity)*/
+    int fill;
+    /*first key of the next leaf to visit (INT_MIN = start of a pass)*/
+    int cursor;
+    long passes, leavesFreed, bytesReclaimed;
+    /*leaves freed in the current pass and 1 if it saw a write*/
+    long passFreed;
+    int dirty;
+    /*1 = the last full pass had nothing to do*/
+    int settled;
+};
+
+/*definitions to resemble types/classes*/
+typedef struct compactorClass * CompactorPtr;
+typedef struct compactorClass Compactor;
+
+/**************** Prototypes ****************/
+
+CompactorPtr createCompactor(int fill);
+int compactStep(CompactorPtr c, NodePtr root, int budget);
+void compactRearm(CompactorPtr c);
+long compactTree(CompactorPtr c, NodePtr root);
+int repackLeaves(NodePtr parent, int first, int n, int target);
+long leafBytes(NodePtr leaf);
+void freeCompactor(CompactorPtr c);
+
+/***************************************************************/
+/************************** FUNCTIONS **************************/
+/***************************************************************/
+
+CompactorPtr createCompactor(int fill) {
+/** Creates a compactor packing leaves to "fill" percent (1 to 100).*/
+    CompactorPtr c = calloc(1, sizeof(Compactor));
+    c->fill = (fill < 1) ? 1 : (fill > 100) ? 100 : fill;
+    c->cursor = INT_MIN;
+    return c;
+}
+
+long leafBytes(NodePtr leaf) {
+/** Heap bytes held by a leaf (node + keys + values).*/
+    return sizeof(Node) + 2 * (leaf->capacity + 2) * sizeof(int);
+}
+
+int repackLeaves(NodePtr parent, int first, int n, int target) {
+/** Repack the "n" sister leaves at children [first: first + n) of
+  * "parent" into the fewest leaves holding at most "target" keys each.
+  * Keys are spread evenly, separators of the parent are rebuilt and the
+  * leaves left empty are freed.
+  * Returns: the number of leaves freed.
+  */
+    NodeRef *ch = parent->children;
+    int nChildren = getChildrenNum(ch, 0);
+    int total = 0, i, j;
+    for (i = 0; i < n; ++i)
+        total += arrSize(DEREF(ch[first + i])->keys);
+
+    // internal nodes keep a key: nodes are ordered by their first key
+    int m = (total + target - 1) / target;
+    if (m < 2 && n == nChildren)
+        m = 2;
+    else if (m < 1)
+        m = 1;
+    if (m >= n)
+        return 0;
+
+    // gather the run in key order
+    int *tKeys = malloc(total * sizeof(int));
+    int *tValues = malloc(total * sizeof(int));
+    int t = 0;
+    for (i = 0; i < n; ++i) {
+        NodePtr leaf = DEREF(ch[first + i]);
+        for (j = 0; leaf->keys[j]; ++j, ++t) {
+            tKeys[t] = leaf->keys[j];
+            tValues[t] = leaf->values[j];
+        }
+    }
+
+    // refill the first m leaves, new separators go to the parent
+    for (i = 0; i < m; ++i) {
+        NodePtr leaf = DEREF(ch[first + i]);
+        int from = (long)total * i / m;
+        int to = (long)total * (i + 1) / m;
+        memset(leaf->keys, 0, (leaf->capacity + 2) * sizeof(int));
+        memset(leaf->values, 0, (leaf->capacity + 2) * sizeof(int));
+        memcpy(leaf->keys, tKeys + from, (to - from) * sizeof(int));
+        memcpy(leaf->values, tValues + from, (to - from) * sizeof(int));
+        if (i > 0)
+            parent->keys[first + i - 1] = tKeys[from];
+    }
+    free(tKeys);
+    free(tValues);
+
+    // unlink the emptied leaves from the sister chain and free them
+    NodePtr last = DEREF(ch[first + m - 1]);
+    last->rightSisterPtr = DEREF(ch[first + n - 1])->rightSisterPtr;
+    if (last->rightSisterPtr)
+        DEREF(last->rightSisterPtr)->leftSisterPtr = REF(last);
+    for (i = m; i < n; ++i)
+        freeNode(DEREF(ch[first + i]));
+
+    // drop their children slots and separators from the parent
+    int nKeys = nChildren - 1;
+    int removed = n - m;
+    memmove(ch + first + m, ch + first + n,
+        (nChildren - first - n) * sizeof(NodeRef));
+    memset(ch + nChildren - removed, 0, removed * sizeof(NodeRef));
+    memmove(parent->keys + first + m - 1, parent->keys + first + n - 1,
+        (nKeys - first - n + 1) * sizeof(int));
+    memset(parent->keys + nKeys - removed, 0, removed * sizeof(int));
+    return removed;
+}
+
+int compactStep(CompactorPtr c, NodePtr root, int budget) {
+/** Run one slice of compaction: visit at most "budget" leaves from the
+  * cursor on, repacking runs of sister leaves with the same parent.
+  * @param c compactor (keeps the cursor and statistics).
+  * @param root ROOT of the tree.
+  * Returns: 1 if the pass reached the last leaf, 0 otherwise.
+  */
+    if (strEqual(root->nodeType, "leaf")) {
+        ++c->passes;
+        c->settled = !c->dirty;
+        c->dirty = 0;
+        return 1;
+    }
+
+    int target = (long)root->tree->leafCapacity * c->fill / 100;
+    if (target < 1)
+        target = 1;
+
+    NodePtr leaf = findLeaf(root, c->cursor);
+    int visited = 0;
+    while (leaf && visited < budget) {
+        NodePtr parent = DEREF(leaf->parentPtr);
+        NodeRef *ch = parent->children;
+        int first = 0, n;
+        while (DEREF(ch[first]) != leaf)
+            ++first;
+        // run: sisters under the same parent, within the budget
+        for (n = 1; ch[first + n] && visited + n < budget; ++n)
+            ;
+
+        long bytes = leafBytes(leaf);
+        int freed = repackLeaves(parent, first, n, target);
+        c->leavesFreed += freed;
+        c->passFreed += freed;
+        c->bytesReclaimed += freed * bytes;
+        visited += n;
+        leaf = DEREF(DEREF(ch[first + n - freed - 1])->rightSisterPtr);
+    }
+
+    if (!leaf) {
+        c->cursor = INT_MIN;
+        ++c->passes;
+        c->settled = !c->passFreed && !c->dirty;
+        c->passFreed = 0;
+        c->dirty = 0;
+        return 1;
+    }
+    c->cursor = leaf->keys[0];
+    return 0;
+}
+
+void compactRearm(CompactorPtr c) {
+/** Report a write to the tree: leaves may need repacking again, so the
+  * current pass doesn't count as settled and slices must run.
+  */
+    c->dirty = 1;
+    c->settled = 0;
+}
+
+long compactTree(CompactorPtr c, NodePtr root) {
+/** Offline rebuild: one full compaction pass without slices.
+  * Returns: bytes reclaimed by the pass.
+  */
+    long before = c->bytesReclaimed;
+    c->cursor = INT_MIN;
+    while (!compactStep(c, root, INT_MAX))
+        ;
+    return c->bytesReclaimed - before;
+}
+
+void freeCompactor(CompactorPtr c) {
+/** Frees the compactor (the tree is not touched).*/
+    free(c);
+}
+
+#endif
@@ -35,6 +35,9 @@ typedef int32_t VAL_t;
 #define GET_PATTERN "g %d\n"
 #define RANGE_PATTERN "r %d %d\n"
 #define LOAD_PATTERN "l %s\n"
+// UPDATE (merge operators: '+' add, '<' min, '>' max, '|' or).
+// Example: 'u 100 + 5'
+#define UPDATE_PATTERN "u %d %c %d\n"
 
 
 // SCAN PATTERNS
@@ -42,5 +45,6 @@ typedef int32_t VAL_t;
 #define GET_PATTERN_SCAN "%d"
 #define RANGE_PATTERN_SCAN "%d %d"
 #define LOAD_PATTERN_SCAN "%s"
+#define UPDATE_PATTERN_SCAN "%d %c %d"
 
 #endif
\ No newline at end of file
@@ -0,0 +1,131 @@
+
+/*
+ * Hash index of every key for O(1) point lookups next to the B+ tree
+ */
+#ifndef HASHINDEX_H
+#define HASHINDEX_H
+
+#include <stdlib.h>
+
+/**
+ * HASH INDEX INFO:
+ * -----------------
+ * - Open-addressing table (linear probing) of key -> value holding EVERY
+ *   key of the tree, so a miss means the key doesn't exist.
+ * - Values are 4B, so they are stored in the table itself: leaf splits,
+ *   buffer flushes and compaction move entries without touching it.
+ *   Only writers of values ("insert", "update") must call "indexPut".
+ * - Key 0 marks empty slots (it is not a valid key in the tree either).
+ * - The table doubles when it is 70% full.
+ */
+
+struct indexSlotClass {
+    int key, value;
+};
+
+struct hashIndexClass {
+    struct indexSlotClass *slots;
+    /*number of slots - 1 (power of 2)*/
+    unsigned int mask;
+    long count;
+    long hits, misses;
+};
+
+/*definitions to resemble types/classes*/
+typedef struct indexSlotClass IndexSlot;
+typedef struct hashIndexClass * IndexPtr;
+typedef struct hashIndexClass HashIndex;
+
+/**************** Prototypes ****************/
+
+IndexPtr createIndex(int entries);
+int indexGet(IndexPtr x, int k, int *v);
+void indexPut(IndexPtr x, int k, int v);
+void indexGrow(IndexPtr x);
+long indexBytes(IndexPtr x);
+void freeIndex(IndexPtr x);
+
+/***************************************************************/
+/************************** FUNCTIONS **************************/
+/***************************************************************/
+
+IndexPtr createIndex(int entries) {
+/** Creates an index with room for "entries" keys before it grows.*/
+    unsigned int nSlots = 64;
+    while (nSlots * 7 / 10 < (unsigned int)entries)
+        nSlots *= 2;
+
+    IndexPtr x = calloc(1, sizeof(HashIndex));
+    x->slots = calloc(nSlots, sizeof(IndexSlot));
+    x->mask = nSlots - 1;
+    return x;
+}
+
+static inline unsigned int indexHash(IndexPtr x, int k) {
+/** First slot of key k (Fibonacci hashing).*/
+    unsigned int h = (unsigned int)k * 2654435769u;
+    return (h ^ (h >> 15)) & x->mask;
+}
+
+int indexGet(IndexPtr x, int k, int *v) {
+/** Returns: 1 and the value in "v" if k is in the tree, 0 otherwise.*/
+    unsigned int i = indexHash(x, k);
+    while (x->slots[i].key) {
+        if (x->slots[i].key == k) {
+            *v = x->slots[i].value;
+            ++x->hits;
+            return 1;
+        }
+        i = (i + 1) & x->mask;
+    }
+    ++x->misses;
+    return 0;
+}
+
+void indexPut(IndexPtr x, int k, int v) {
+/** Add (k, v) or replace the value of k.*/
+    unsigned int i = indexHash(x, k);
+    while (x->slots[i].key && x->slots[i].key != k)
+        i = (i + 1) & x->mask;
+    if (!x->slots[i].key) {
+        x->slots[i].key = k;
+        if (++x->count * 10 >= (long)(x->mask + 1) * 7) {
+            x->slots[i].value = v;
+            indexGrow(x);
+            return;
+        }
+    }
+    x->slots[i].value = v;
+}
+
+void indexGrow(IndexPtr x) {
+/** Double the number of slots and re-insert every key.*/
+    IndexSlot *old = x->slots;
+    unsigned int nOld = x->mask + 1, i;
+    x->mask = 2 * nOld - 1;
+    x->slots = calloc(2 * nOld, sizeof(IndexSlot));
+    for (i = 0; i < nOld; ++i) {
+        if (old[i].key) {
+            unsigned int j = indexHash(x, old[i].key);
+            while (x->slots[j].key)
+                j = (j + 1) & x->mask;
+            x->slots[j] = old[i];
+        }
+    }
+    free(old);
+}
+
+long indexBytes(IndexPtr x) {
+/** Heap bytes held by the index.*/
+    return sizeof(HashIndex) + (long)(x->mask + 1) * sizeof(IndexSlot);
+}
+
+void freeIndex(IndexPtr x) {
+/** Frees all memory of the index.*/
+    if (x) {
+        free(x->slots);
+        free(x);
+    }
+}
+
+#endif
@@ -0,0 +1,193 @@
+
+/*
+ * Lookup hints (finger search) for clustered gets and puts
+ */
+#ifndef HINT_H
+#define HINT_H
+#include "btree.h"
+
+#include <limits.h>
+#include <stdlib.h>
+
+/**
+ * HINT INFO:
+ * -----------
+ * - A hint remembers the last descent: the node at every level, its
+ *   position in the parent and the key bounds [low: high) given by the
+ *   separators above it.
+ * - The next lookup starts at the hinted leaf. If the key is out of its
+ *   bounds, sister leaves of the same parent are walked (up to
+ *   HINT_MAX_WALK), then the path is climbed only until a node whose
+ *   bounds hold the key, and the descent restarts from there.
+ * - Splits and compaction release nodes and bump "nodeEpoch". A hint
+ *   taken at another epoch (or on another tree) starts from the root.
+ * - Write-buffered trees always start from the root: pending messages
+ *   live in the buffers of the path. Gets of trees with a hash index
+ *   go to the index: it is O(1), a hint only saves the descent.
+ * - With a read cache, a get whose key is in the bounds of the hinted
+ *   leaf reads the leaf directly (one node, already in the CPU cache)
+ *   and skips the cache probe. Other gets probe the cache first.
+ * - Hinted puts still write through to the index and the cache of the
+ *   tree, otherwise later gets would return stale values.
+ */
+
+#define HINT_MAX_DEPTH 32
+#define HINT_MAX_WALK 4
+
+struct hintClass {
+    /*tree and epoch of the remembered path*/
+    NodePtr root;
+    unsigned long epoch;
+    /*levels in the path ([depth - 1] = leaf, 0 = no path)*/
+    int depth;
+    NodePtr path[HINT_MAX_DEPTH];
+    /*position of path[i] among the children of path[i - 1]*/
+    int slot[HINT_MAX_DEPTH];
+    /*keys under path[i] are in [low[i]: high[i])*/
+    long low[HINT_MAX_DEPTH], high[HINT_MAX_DEPTH];
+    /*lookups, lookups served by the hinted leaf or its sisters, sister
+      steps and internal nodes visited*/
+    long lookups, leafHits, sisterSteps, nodeVisits;
+};
+
+/*definitions to resemble types/classes*/
+typedef struct hintClass * HintPtr;
+typedef struct hintClass Hint;
+
+/**************** Prototypes ****************/
+
+HintPtr createHint(void);
+int hintHolds(HintPtr h, NodePtr root, int k);
+NodePtr hintLeaf(HintPtr h, NodePtr root, int k);
+int findWithHint(NodePtr root, HintPtr h, int k);
+NodePtr insertWithHint(NodePtr root, HintPtr h, int k, int v);
+void freeHint(HintPtr h);
+
+/***************************************************************/
+/************************** FUNCTIONS **************************/
+/***************************************************************/
+
+HintPtr createHint(void) {
+/** Creates an empty hint (the first lookup starts at the root).*/
+    return calloc(1, sizeof(Hint));
+}
+
+int hintHolds(HintPtr h, NodePtr root, int k) {
+/** Returns: 1 if "k" is in the bounds of the hinted leaf of "root"
+  * (the path is still valid), 0 otherwise.
+  */
+    return h->root == root && h->epoch == nodeEpoch && h->depth &&
+        k >= h->low[h->depth - 1] && k < h->high[h->depth - 1];
+}
+
+NodePtr hintLeaf(HintPtr h, NodePtr root, int k) {
+/** Return the leaf where "k" belongs, starting from the hinted path,
+  * and remember the path taken.
+  * @param h hint (updated).
+  * @param root ROOT of the tree.
+  */
+    int d;
+    ++h->lookups;
+
+    if (h->root != root || h->epoch != nodeEpoch || !h->depth) {
+        h->root = root;
+        h->epoch = nodeEpoch;
+        h->path[0] = root;
+        h->low[0] = LONG_MIN;
+        h->high[0] = LONG_MAX;
+        d = 0;
+    }
+    else {
+        d = h->depth - 1;
+        // sisters of the same parent: bounds come from its separators, so
+        // only the leaf reached at the end is touched
+        if (d > 0 && k >= h->low[d - 1] && k < h->high[d - 1]) {
+            NodePtr parent = h->path[d - 1];
+            int s = h->slot[d], steps = 0;
+            while (steps < HINT_MAX_WALK && k >= h->high[d]) {
+                ++s;
+                h->low[d] = h->high[d];
+                h->high[d] = parent->keys[s] ? parent->keys[s] : h->high[d - 1];
+                ++steps;
+            }
+            while (steps < HINT_MAX_WALK && k < h->low[d]) {
+                --s;
+                h->high[d] = h->low[d];
+                h->low[d] = s ? parent->keys[s - 1] : h->low[d - 1];
+                ++steps;
+            }
+            if (steps == 1)
+                h->path[d] = DEREF((s > h->slot[d]) ?
+                    h->path[d]->rightSisterPtr : h->path[d]->leftSisterPtr);
+            else if (steps)
+                h->path[d] = DEREF(parent->children[s]);
+            h->slot[d] = s;
+            h->sisterSteps += steps;
+        }
+        if (k >= h->low[d] && k < h->high[d])
+            ++h->leafHits;
+        // climb until a node holds k (the root holds every key)
+        while (k < h->low[d] || k >= h->high[d])
+            --d;
+    }
+
+    while (strEqual(h->path[d]->nodeType, "node")) {
+        // deeper than a hint can remember
+        if (d + 1 == HINT_MAX_DEPTH) {
+            h->depth = 0;
+            return findLeaf(h->path[d], k);
+        }
+        NodePtr p = h->path[d];
+        int i = childSlot(p, k);
+        h->path[d + 1] = DEREF(p->children[i]);
+        h->slot[d + 1] = i;
+        h->low[d + 1] = i ? p->keys[i - 1] : h->low[d];
+        h->high[d + 1] = p->keys[i] ? p->keys[i] : h->high[d];
+        ++h->nodeVisits;
+        ++d;
+    }
+    h->depth = d + 1;
+    return h->path[d];
+}
+
+int findWithHint(NodePtr root, HintPtr h, int k) {
+/** Same as "find" but the leaf is reached through the hint.*/
+    int v = 0;
+    if (root->buffer || root->tree->index || !h)
+        return find(root, k);
+    // the hinted leaf is as cheap as a cache probe: keep the cache for
+    // keys elsewhere in the tree
+    CachePtr cache = root->tree->cache;
+    int cached = cache && !hintHolds(h, root, k);
+    if (cached && cacheGet(cache, k, &v))
+        return v;
+
+    NodePtr leaf = hintLeaf(h, root, k);
+    int i = leafSearch(leaf, k);
+    if (i >= 0)
+        v = leaf->values[i];
+
+    if (cached && v)
+        cachePut(cache, k, v);
+    return v;
+}
+
+NodePtr insertWithHint(NodePtr root, HintPtr h, int k, int v) {
+/** Same as "insert" but the leaf is reached through the hint.
+  * Returns: the ROOT of the tree.
+  */
+    if (root->buffer || !h)
+        return insert(root, k, v);
+    if (root->tree->index)
+        indexPut(root->tree->index, k, v);
+    if (root->tree->cache)
+        cacheUpdate(root->tree->cache, k, v);
+    return insertAtLeaf(hintLeaf(h, root, k), k, v);
+}
+
+void freeHint(HintPtr h) {
+/** Frees the hint (the tree is not touched).*/
+    free(h);
+}
+
+#endif
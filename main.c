@@ -13,12 +13,16 @@
 #include "data_types.h"
 
 #include "btree.h"
+#include "compact.h"
+#include "hint.h"
+#include "server.h"
 
 /*
  * parses a query command (one line), and routes it to the corresponding
  * storage engine methods
  */
-int parseRouteQuery(char queryLine[], NodePtr nodePtr){
+int parseRouteQuery(
+    char queryLine[], NodePtr nodePtr, PoolPtr pool, HintPtr hint){
   if(strlen(queryLine) <= 0){
      perror("parseQuery: queryLine length is empty or malspecified.");
      return -1;
@@ -30,6 +34,7 @@ int parseRouteQuery(char queryLine[], NodePtr nodePtr){
 
   KEY_t key, lowKey, highKey;
   VAL_t val;
+  char op;
 
   // finish loadPath
   // read a binary file
@@ -39,12 +44,12 @@ int parseRouteQuery(char queryLine[], NodePtr nodePtr){
   (void) loadPath;
 
   if ( sscanf(queryLine, PUT_PATTERN, &key, &val) >= 1) {
-    *nodePtr = *(insert(nodePtr, key, val));
+    *nodePtr = *(insertWithHint(nodePtr, hint, key, val));
 
     // printf(PUT_PATTERN, key, val);
   }
   else if( sscanf(queryLine, GET_PATTERN, &key) >= 1 ) {
-    int value = find(nodePtr, key);
+    int value = findWithHint(nodePtr, hint, key);
     if (value == 0)
       printf("\n");
     else
@@ -53,7 +58,7 @@ int parseRouteQuery(char queryLine[], NodePtr nodePtr){
     // printf(GET_PATTERN, key);
   }
   else if( sscanf(queryLine, RANGE_PATTERN, &lowKey, &highKey) >= 1 ) {
-    int* ptr = range(nodePtr, lowKey, highKey);
+    int* ptr = parallelRange(pool, nodePtr, lowKey, highKey);
     if (ptr) {
       while (*ptr) {
         printf("%d\n", *ptr);
@@ -63,6 +68,11 @@ int parseRouteQuery(char queryLine[], NodePtr nodePtr){
 
     // printf(RANGE_PATTERN, lowKey, highKey);
   }
+  else if( sscanf(queryLine, UPDATE_PATTERN, &key, &op, &val) == 3 ) {
+    *nodePtr = *(update(nodePtr, key, op, val));
+
+    // printf(UPDATE_PATTERN, key, op, val);
+  }
   else {
     // query not parsed. handle the query as unknown
     return -1;
@@ -74,17 +84,27 @@ int parseRouteQuery(char queryLine[], NodePtr nodePtr){
 int main(int argc, char *argv[])
 {
 
-  // Tree parameters
-  const int d_PARAMETER = 124;
-  // Max capacity = 248 keys ~ 4kb (page size)
-  // Allocation (in leaf nodes):
-  // keys = (248 + 2) * 4B = 1000B
-  // values = (248 + 2) * 4B = 1000B
-  // Node = 2064B
-  const int NODE_CAPACITY = 2 * d_PARAMETER;
+  // Tree parameters: leaves hold keys + values, internal nodes hold
+  // keys + child pointers, so each gets its own capacity.
+  // Both are sized in bytes (4KB, one page):
+  // Allocation (leaf, 510 keys):
+  // keys = (510 + 2) * 4B = 2048B
+  // values = (510 + 2) * 4B = 2048B
+  // Allocation (internal node, 338 keys):
+  // keys = (338 + 2) * 4B = 1360B
+  // children = (338 + 3) * 8B = 2728B
+  // With COMPACT_REFS children are 4B ids and 4KB hold 509 keys (higher
+  // fanout, lower tree).
+  // "make sweep" finds the best sizes for the host. "-L <bytes>" and
+  // "-N <bytes>" set them at run time (leafCapacityFor/nodeCapacityFor).
+  const int LEAF_CAP = leafCapacityFor(4096);
+  const int NODE_CAP = nodeCapacityFor(4096);
   // Initial TREE ROOT
-  NodePtr parent = NULL;
-  NodePtr rootPtr = createNode("leaf", NODE_CAPACITY, parent);
+  NodePtr rootPtr = createTree(LEAF_CAP, NODE_CAP, 0);
+  // internal node capacity before "-b" takes part of it for the buffer,
+  // and the buffer size asked for (it may not fit in smaller nodes)
+  int unbufferedNodeCap = NODE_CAP;
+  int bufferRequest = 0;
 
   /**********************************************************/
   /**********************************************************/
@@ -94,20 +114,129 @@ int main(int argc, char *argv[])
   // initial command line argument parsing
   int queriesSourcedFromFile = 0;
   char fileReadBuffer[1023];
+  // worker pool for range scans ("-t <threads>", 0 = all cores).
+  // Options must come before "-f" to be used by the file queries.
+  PoolPtr pool = NULL;
+  // online leaf compaction ("-C <fill %>"), NULL = disabled
+  CompactorPtr compactor = NULL;
+  // lookup hint for clustered gets/puts ("-F"), NULL = from the root
+  HintPtr hint = NULL;
+  // nonzero when the server could not be started
+  int exitStatus = 0;
 	// parse any filepath option for queries input file
-	while((opt = getopt(argc, argv, ":if:lrx")) != -1) {
+	while((opt = getopt(argc, argv, ":if:lrxt:b:s:c:L:N:C:FI:M:")) != -1) {
 
 		switch(opt) {
+			case 'b': {
+          // write-optimized mode: internal nodes buffer up to <n>
+          // pending upserts in up to 3/4 of their bytes (fanout shrinks
+          // to make room). Set before any put.
+          bufferRequest = atoi(optarg);
+          int bufferCap = bufferRequest;
+          rootPtr->tree->nodeCapacity =
+              bufferedNodeCapacity(unbufferedNodeCap, &bufferCap);
+          rootPtr->tree->bufferCapacity = bufferCap;
+          printf("write buffer: %d, node capacity %d\n",
+              rootPtr->tree->bufferCapacity, rootPtr->tree->nodeCapacity);
+          break;
+      }
+			case 't':
+          freePool(pool);
+          pool = createPool(atoi(optarg) > 0 ? atoi(optarg) : defaultThreads());
+          printf("threads: %d\n", pool->nThreads);
+          break;
+			case 'L':
+			case 'N': {
+          // leaf / internal node size in bytes. Set before any put.
+          int leafCap = (opt == 'L') ?
+              leafCapacityFor(atoi(optarg)) : rootPtr->tree->leafCapacity;
+          if (opt == 'N')
+              unbufferedNodeCap = nodeCapacityFor(atoi(optarg));
+          NodePtr newRoot = createTree(
+              leafCap, unbufferedNodeCap, bufferRequest);
+          newRoot->tree->cache = rootPtr->tree->cache;
+          newRoot->tree->index = rootPtr->tree->index;
+          rootPtr->tree->cache = NULL;
+          rootPtr->tree->index = NULL;
+          freeNode(rootPtr);
+          rootPtr = newRoot;
+          printf("capacity: leaf %d, node %d\n",
+              rootPtr->tree->leafCapacity, rootPtr->tree->nodeCapacity);
+          break;
+      }
+			case 'M': {
+          // node memory: 'h' = 2MB huge pages, 'n' = pages interleaved
+          // over NUMA nodes ("-M hn" = both). Set before any put: the
+          // root and the node pool chunks are freed before the allocator
+          // changes.
+          int flags = (strchr(optarg, 'h') ? NODEMEM_HUGE : 0) |
+              (strchr(optarg, 'n') ? NODEMEM_INTERLEAVE : 0);
+          CachePtr cache = rootPtr->tree->cache;
+          IndexPtr index = rootPtr->tree->index;
+          int leafCap = rootPtr->tree->leafCapacity;
+          rootPtr->tree->cache = NULL;
+          rootPtr->tree->index = NULL;
+          freeNode(rootPtr);
+          freeNodePool();
+          int numaNodes = setNodeMemory(flags);
+          rootPtr = createTree(leafCap, unbufferedNodeCap, bufferRequest);
+          rootPtr->tree->cache = cache;
+          rootPtr->tree->index = index;
+          printf("node memory: %s, %d NUMA nodes\n",
+              (flags & NODEMEM_HUGE) ? "huge pages" : "4kb pages", numaNodes);
+          break;
+      }
+			case 'c':
+          // hot-key read cache in front of "find" with <n> entries
+          freeCache(rootPtr->tree->cache);
+          rootPtr->tree->cache = createCache(atoi(optarg));
+          break;
+			case 'I':
+          // hash index of every key: O(1) gets, <n> = expected keys
+          indexTree(rootPtr, atoi(optarg));
+          break;
+			case 'C':
+          // repack leaves to <fill> % in slices between queries
+          freeCompactor(compactor);
+          compactor = createCompactor(atoi(optarg));
+          printf("compaction: fill %d%%\n", compactor->fill);
+          break;
+			case 'F':
+          // gets and puts start from the last leaf (finger search)
+          if (!hint)
+              hint = createHint();
+          break;
+			case 's':
+          // serve queries over a Unix socket until a 'q' is received
+          if (runServer(optarg, rootPtr, pool, compactor) < 0)
+              exitStatus = 1;
+          break;
 			case 'f':
 				printf("filepath: %s\n", optarg);
 				queriesSourcedFromFile = 1;
 
           FILE *fp = fopen(optarg, "r");
+          long queries = 0;
           while(fgets(fileReadBuffer, 1023, fp)){
-              parseRouteQuery(fileReadBuffer, rootPtr);
+              parseRouteQuery(fileReadBuffer, rootPtr, pool, hint);
+              // like the server: writes rearm a settled compactor
+              if (compactor && (*fileReadBuffer == 'p' ||
+                  *fileReadBuffer == 'u'))
+                  compactRearm(compactor);
+              if (compactor && ++queries % COMPACT_INTERVAL == 0 &&
+                  !compactor->settled)
+                  compactStep(compactor, rootPtr, COMPACT_SLICE);
           }
 
           fclose(fp);
+          if (compactor)
+              printf("compaction: %ld leaves freed, %ld bytes reclaimed, "
+                  "%ld passes%s\n", compactor->leavesFreed,
+                  compactor->bytesReclaimed, compactor->passes,
+                  compactor->settled ? ", settled" : "");
+          if (hint)
+              printf("hints: %ld lookups, %ld leaf hits, %ld internal nodes\n",
+                  hint->lookups, hint->leafHits, hint->nodeVisits);
           break;
 		}
 	}
@@ -137,16 +266,29 @@ int main(int argc, char *argv[])
   // testRangeScan(rootPtr, -500, 150);
   // testRangeScan(rootPtr, 900, 1050);
 
+  // parallel versions (need "-t <threads>")
+  // testParallelRangeScan(pool, rootPtr, -1000000000, 1000000000);
+  // parallelTreeInfo(pool, rootPtr);
+
+  // one full compaction pass (needs "-C <fill %>")
+  // compactTree(compactor, rootPtr);
+
   // treeInfo(rootPtr);
   // printTreeKeys(rootPtr);
 
   // to free all memory in tree.
   // freeTree(rootPtr);
+  // parallelFreeTree(pool, rootPtr);
+
+  freePool(pool);
+  freeCompactor(compactor);
+  freeHint(hint);
 
   /**********************************************************/
-  return 0;
+  return exitStatus;
 }
 
 // to run navigate to directory and:
 // "make && ./main -f txtSamples/<workloadFileName>.txt" or
+// "make && ./main -s /tmp/kv.sock" or
 // "make && ./main"
@@ -0,0 +1,231 @@
+
+/*
+ * Backing memory of tree nodes: huge pages and NUMA interleaving
+ */
+#ifndef NODEMEM_H
+#define NODEMEM_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * NODE MEMORY INFO:
+ * ------------------
+ * - By default nodes and their keys/values/children arrays come from
+ *   calloc and are spread over 4KB pages: random lookups in a large tree
+ *   miss the TLB on almost every node.
+ * - "setNodeMemory" moves them to an arena of NODEMEM_REGION mappings.
+ *   Blocks are rounded up to a cache line and released blocks are reused
+ *   per size (a tree only has a few array sizes). Bigger blocks than the
+ *   last size class get their own mapping.
+ * - NODEMEM_HUGE: regions are mapped with 2MB pages (MAP_HUGETLB, needs
+ *   pages reserved in /proc/sys/vm/nr_hugepages). When none are left the
+ *   region is aligned to 2MB and marked for transparent huge pages.
+ * - NODEMEM_INTERLEAVE: pages of every region are spread round-robin
+ *   over the online NUMA nodes (mbind syscall, first 64 nodes), so
+ *   threads on every socket see the same average latency. Nothing to do
+ *   on single-node hosts.
+ * - The mode must be set while no nodes exist: blocks don't remember
+ *   which allocator they come from.
+ */
+
+#define NODEMEM_HUGE 1
+#define NODEMEM_INTERLEAVE 2
+
+#define HUGE_PAGE (2UL << 20)
+#define NODEMEM_REGION (16 * HUGE_PAGE)
+/*block granularity (one cache line) and number of size classes (1MB)*/
+#define NODEMEM_ALIGN 64
+#define NODEMEM_CLASSES 16384
+
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+struct nodeMemClass {
+    /*NODEMEM_* flags (0 = calloc/free)*/
+    int flags;
+    /*online NUMA nodes (bit mask) and how many*/
+    unsigned long numaMask;
+    int numaNodes;
+    /*free space of the current region*/
+    char *next;
+    size_t left;
+    /*regions mapped: all, with MAP_HUGETLB, with THP, interleaved*/
+    long regions, hugeRegions, thpRegions, interleaved;
+    long mappedBytes, usedBytes;
+    /*released blocks of every size class, chained through their first
+      bytes*/
+    void *freeLists[NODEMEM_CLASSES];
+};
+
+/*single arena shared by all trees (like the node pool)*/
+static struct nodeMemClass nodeMem;
+static pthread_mutex_t nodeMemLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**************** Prototypes ****************/
+
+int setNodeMemory(int flags);
+int numaOnlineNodes(unsigned long *mask);
+void *mapRegion(size_t bytes);
+void *nodeAlloc(size_t bytes);
+void nodeFree(void *p, size_t bytes);
+
+/***************************************************************/
+/************************** FUNCTIONS **************************/
+/***************************************************************/
+
+int setNodeMemory(int flags) {
+/** Choose where nodes are allocated from now on (no nodes may exist).
+  * @param flags NODEMEM_HUGE and/or NODEMEM_INTERLEAVE, 0 = calloc.
+  * Returns: number of NUMA nodes pages are interleaved over (1 = none).
+  */
+    nodeMem.flags = flags;
+    nodeMem.numaNodes = numaOnlineNodes(&nodeMem.numaMask);
+    return (flags & NODEMEM_INTERLEAVE) ? nodeMem.numaNodes : 1;
+}
+
+int numaOnlineNodes(unsigned long *mask) {
+/** Read the online NUMA nodes ("0-1,3" list in sysfs) into "mask".
+  * Returns: number of nodes (1 if unknown).
+  */
+    char line[256], *s = line;
+    int n = 0;
+    FILE *fp = fopen("/sys/devices/system/node/online", "r");
+    *mask = 0;
+    if (fp && fgets(line, sizeof(line), fp)) {
+        while (*s >= '0' && *s <= '9') {
+            long a = strtol(s, &s, 10), b = a;
+            if (*s == '-')
+                b = strtol(s + 1, &s, 10);
+            for (; a <= b && a < 64; ++a, ++n)
+                *mask |= 1UL << a;
+            if (*s == ',')
+                ++s;
+        }
+    }
+    if (fp)
+        fclose(fp);
+    if (!n) {
+        *mask = 1;
+        n = 1;
+    }
+    return n;
+}
+
+void *mapRegion(size_t bytes) {
+/** Map "bytes" (multiple of 2MB) with the page size and NUMA policy of
+  * the current mode. Called with the arena locked.
+  * Returns: the region, NULL if the system is out of memory.
+  */
+    char *p = MAP_FAILED;
+    if (nodeMem.flags & NODEMEM_HUGE) {
+        p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+            ++nodeMem.hugeRegions;
+    }
+    if (p == MAP_FAILED) {
+        // map one extra huge page and trim it, so the region starts at
+        // a 2MB boundary (THP only backs aligned 2MB ranges)
+        char *raw = mmap(NULL, bytes + HUGE_PAGE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED)
+            return NULL;
+        p = (char *)(((unsigned long)raw + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+        if (p > raw)
+            munmap(raw, p - raw);
+        munmap(p + bytes, raw + HUGE_PAGE - p);
+        if ((nodeMem.flags & NODEMEM_HUGE) &&
+            !madvise(p, bytes, MADV_HUGEPAGE))
+            ++nodeMem.thpRegions;
+    }
+    // pages are not touched yet, so the policy applies to all of them
+    if ((nodeMem.flags & NODEMEM_INTERLEAVE) && nodeMem.numaNodes > 1 &&
+        !syscall(SYS_mbind, p, bytes, MPOL_INTERLEAVE, &nodeMem.numaMask,
+            8 * sizeof(unsigned long) + 1, 0))
+        ++nodeMem.interleaved;
+
+    ++nodeMem.regions;
+    nodeMem.mappedBytes += bytes;
+    return p;
+}
+
+void *nodeAlloc(size_t bytes) {
+/** Return a zeroed block of "bytes" for a node or one of its arrays.*/
+    if (!nodeMem.flags)
+        return calloc(1, bytes);
+
+    size_t size = bytes ?
+        (bytes + NODEMEM_ALIGN - 1) / NODEMEM_ALIGN * NODEMEM_ALIGN :
+        NODEMEM_ALIGN;
+    size_t c = size / NODEMEM_ALIGN;
+    void *p;
+
+    pthread_mutex_lock(&nodeMemLock);
+    if (c >= NODEMEM_CLASSES) {
+        size = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+        p = mapRegion(size);
+    }
+    else if ((p = nodeMem.freeLists[c])) {
+        nodeMem.freeLists[c] = *(void **)p;
+        // only the link was written after it was zeroed by "nodeFree"
+        *(void **)p = NULL;
+    }
+    else {
+        if (nodeMem.left < size) {
+            // the tail of the old region is too small, it is left unused
+            nodeMem.next = mapRegion(NODEMEM_REGION);
+            nodeMem.left = nodeMem.next ? NODEMEM_REGION : 0;
+        }
+        if (nodeMem.left >= size) {
+            p = nodeMem.next;
+            nodeMem.next += size;
+            nodeMem.left -= size;
+        }
+    }
+    if (p)
+        nodeMem.usedBytes += size;
+    pthread_mutex_unlock(&nodeMemLock);
+    return p;
+}
+
+void nodeFree(void *p, size_t bytes) {
+/** Give back a block of "nodeAlloc" ("bytes" = size requested).*/
+    if (!nodeMem.flags) {
+        free(p);
+        return;
+    }
+    if (!p)
+        return;
+
+    size_t size = bytes ?
+        (bytes + NODEMEM_ALIGN - 1) / NODEMEM_ALIGN * NODEMEM_ALIGN :
+        NODEMEM_ALIGN;
+    size_t c = size / NODEMEM_ALIGN;
+
+    if (c >= NODEMEM_CLASSES) {
+        size = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+        munmap(p, size);
+        pthread_mutex_lock(&nodeMemLock);
+        --nodeMem.regions;
+        nodeMem.mappedBytes -= size;
+        nodeMem.usedBytes -= size;
+        pthread_mutex_unlock(&nodeMemLock);
+        return;
+    }
+    // zeroed here, outside the lock of "nodeAlloc"
+    memset(p, 0, size);
+    pthread_mutex_lock(&nodeMemLock);
+    *(void **)p = nodeMem.freeLists[c];
+    nodeMem.freeLists[c] = p;
+    nodeMem.usedBytes -= size;
+    pthread_mutex_unlock(&nodeMemLock);
+}
+
+#endif
@@ -0,0 +1,367 @@
+
+/*
+ * Local server mode: keeps the tree resident and serves the DSL of
+ * data_types.h over a Unix domain socket
+ */
+#ifndef SERVER_H
+#define SERVER_H
+#include "data_types.h"
+#include "btree.h"
+#include "compact.h"
+#include "hint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * SERVER INFO:
+ * -------------
+ * - One epoll loop, non-blocking sockets, no threads (range scans may
+ *   still use the worker pool).
+ * - Requests are lines of the DSL ('p', 'g', 'r', 'u'). Clients can pipeline
+ *   any number of them per write.
+ * - Replies are sent in request order, one write per batch of requests:
+ *   'p', 'u' -> nothing (same as file mode).
+ *   'g' -> "value\n", or "\n" if the key doesn't exist.
+ *   'r' -> "value\n" for every value in range, then "\n".
+ * - Runs of consecutive gets (or writes: puts and updates) from a
+ *   connection are executed in key order through a lookup hint, so
+ *   neighbouring keys skip the upper levels of the tree. Writes to the
+ *   same key keep their order.
+ * - 'q' stops the server.
+ * - With a compactor, a compaction slice runs after every wake-up and
+ *   every COMPACT_IDLE_MS while idle.
+ */
+
+#define MAX_EVENTS 64
+#define READ_CHUNK 65536
+
+struct connClass {
+    int fd;
+    /*peer finished sending*/
+    int eof;
+    /*list of open connections*/
+    struct connClass *prev, *next;
+    /*unparsed input (may end with a partial line)*/
+    char *in;
+    int inLen, inCap;
+    /*replies not written yet*/
+    char *out;
+    int outLen, outCap, outSent;
+};
+
+struct requestClass {
+    /*DSL command and merge operator of updates*/
+    char type, op;
+    int key, val;
+    /*position in the batch (keeps replies and same-key puts in order)*/
+    int pos;
+};
+
+/*definitions to resemble types/classes*/
+typedef struct connClass Conn;
+typedef struct requestClass Request;
+
+/**************** Prototypes ****************/
+
+int runServer(
+    char *socketPath, NodePtr rootPtr, PoolPtr pool, CompactorPtr compactor);
+int handleInput(Conn *c, NodePtr rootPtr, PoolPtr pool, int *wrote);
+int flushOutput(Conn *c);
+void closeConn(int epfd, Conn *c, Conn **conns);
+void outAppend(Conn *c, char *str, int len);
+void outInt(Conn *c, int v);
+int runBatch(Conn *c, Request *reqs, int n, NodePtr rootPtr);
+int compareRequests(const void *l, const void *r);
+
+/***************************************************************/
+/************************** FUNCTIONS **************************/
+/***************************************************************/
+
+void outAppend(Conn *c, char *str, int len) {
+/** Append bytes to the reply buffer of a connection.*/
+    if (c->outLen + len > c->outCap) {
+        while (c->outLen + len > c->outCap)
+            c->outCap = c->outCap ? c->outCap * 2 : 4096;
+        c->out = realloc(c->out, c->outCap);
+    }
+    memcpy(c->out + c->outLen, str, len);
+    c->outLen += len;
+}
+
+void outInt(Conn *c, int v) {
+/** Append "v\n" to the reply buffer.*/
+    char num[16];
+    outAppend(c, num, sprintf(num, "%d\n", v));
+}
+
+int compareRequests(const void *l, const void *r) {
+/** Order requests by key, then by arrival.*/
+    const Request *a = l, *b = r;
+    if (a->key != b->key)
+        return (a->key < b->key) ? -1 : 1;
+    return a->pos - b->pos;
+}
+
+int runBatch(Conn *c, Request *reqs, int n, NodePtr rootPtr) {
+/** Execute a run of gets or writes in key order. Same-key writes keep
+  * their arrival order, get replies go out in arrival order.
+  * Returns: 1 if the run wrote to the tree, 0 for gets.
+  */
+    int i;
+    Hint hint;
+    memset(&hint, 0, sizeof(Hint));
+    if (n > 1)
+        qsort(reqs, n, sizeof(Request), compareRequests);
+
+    if (reqs[0].type != 'g') {
+        for (i = 0; i < n; ++i) {
+            if (reqs[i].type == 'p')
+                *rootPtr = *(insertWithHint(
+                    rootPtr, &hint, reqs[i].key, reqs[i].val));
+            else
+                *rootPtr = *(update(rootPtr, reqs[i].key, reqs[i].op,
+                    reqs[i].val));
+        }
+        return 1;
+    }
+
+    int *replies = malloc(n * sizeof(int));
+    for (i = 0; i < n; ++i)
+        replies[reqs[i].pos] = findWithHint(rootPtr, &hint, reqs[i].key);
+    for (i = 0; i < n; ++i) {
+        if (replies[i] == 0)
+            outAppend(c, "\n", 1);
+        else
+            outInt(c, replies[i]);
+    }
+    free(replies);
+    return 0;
+}
+
+int handleInput(Conn *c, NodePtr rootPtr, PoolPtr pool, int *wrote) {
+/** Parse and run every complete line in the input buffer.
+  * @param wrote set to 1 if puts or updates were run.
+  * Returns: 1 if a 'q' request was found, 0 otherwise.
+  */
+    int quit = 0, n = 0, cap = 64;
+    int lineStart = 0, i;
+    Request *reqs = malloc(cap * sizeof(Request));
+
+    for (i = 0; i < c->inLen && !quit; ++i) {
+        if (c->in[i] != '\n')
+            continue;
+        c->in[i] = '\0';
+        char *line = c->in + lineStart;
+        lineStart = i + 1;
+
+        Request r;
+        int lowKey, highKey;
+        r.type = line[0];
+        if ((r.type == 'p' && sscanf(line, PUT_PATTERN, &r.key, &r.val) == 2)
+         || (r.type == 'g' && sscanf(line, GET_PATTERN, &r.key) == 1)
+         || (r.type == 'u'
+             && sscanf(line, UPDATE_PATTERN, &r.key, &r.op, &r.val) == 3)) {
+            // a get ends a run of writes and the other way around
+            if (n > 0 && (reqs[0].type == 'g') != (r.type == 'g')) {
+                *wrote |= runBatch(c, reqs, n, rootPtr);
+                n = 0;
+            }
+            if (n == cap) {
+                cap *= 2;
+                reqs = realloc(reqs, cap * sizeof(Request));
+            }
+            r.pos = n;
+            reqs[n++] = r;
+            continue;
+        }
+
+        if (n > 0) {
+            *wrote |= runBatch(c, reqs, n, rootPtr);
+            n = 0;
+        }
+        if (r.type == 'r'
+            && sscanf(line, RANGE_PATTERN, &lowKey, &highKey) == 2) {
+            int *result = parallelRange(pool, rootPtr, lowKey, highKey);
+            int *ptr = result;
+            while (ptr && *ptr) {
+                outInt(c, *ptr);
+                ++ptr;
+            }
+            outAppend(c, "\n", 1);
+            free(result);
+        }
+        else if (r.type == 'q')
+            quit = 1;
+    }
+    if (n > 0)
+        *wrote |= runBatch(c, reqs, n, rootPtr);
+    free(reqs);
+
+    // keep the partial line for the next read
+    memmove(c->in, c->in + lineStart, c->inLen - lineStart);
+    c->inLen -= lineStart;
+    return quit;
+}
+
+int flushOutput(Conn *c) {
+/** Write as much of the reply buffer as the socket takes.
+  * Returns: 1 if everything was written, 0 if the socket is full,
+  * -1 on error.
+  */
+    while (c->outSent < c->outLen) {
+        ssize_t w = write(c->fd, c->out + c->outSent, c->outLen - c->outSent);
+        if (w < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        c->outSent += w;
+    }
+    c->outLen = c->outSent = 0;
+    return 1;
+}
+
+void closeConn(int epfd, Conn *c, Conn **conns) {
+/** Unregister, close and free a connection.*/
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        *conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+int runServer(
+    char *socketPath, NodePtr rootPtr, PoolPtr pool, CompactorPtr compactor) {
+/** Serve requests on a Unix domain socket until a 'q' is received.
+  * @param socketPath path of the socket file (a stale socket there is
+  * replaced, any other file is left alone and the server doesn't start).
+  * @param rootPtr ROOT of the (resident) tree.
+  * @param pool worker pool for range scans (NULL = serial).
+  * @param compactor online leaf compaction (NULL = disabled).
+  * Returns: 0 on a clean stop, -1 if the socket can't be set up.
+  */
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        perror("runServer: socket path is too long.");
+        return -1;
+    }
+    strcpy(addr.sun_path, socketPath);
+
+    struct stat st;
+    if (lstat(socketPath, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "runServer: %s exists and is not a socket.\n",
+                socketPath);
+            return -1;
+        }
+        unlink(socketPath);
+    }
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(lfd, SOMAXCONN) < 0) {
+        perror("runServer: can't listen on socket.");
+        if (lfd >= 0)
+            close(lfd);
+        return -1;
+    }
+
+    int epfd = epoll_create1(0);
+    struct epoll_event ev, events[MAX_EVENTS];
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+    printf("server: listening on %s\n", socketPath);
+    fflush(stdout);
+
+    Conn *conns = NULL;
+    int quit = 0;
+    while (!quit) {
+        // idle slices stop once a full pass frees nothing
+        int nEvents = epoll_wait(epfd, events, MAX_EVENTS,
+            (compactor && !compactor->settled) ? COMPACT_IDLE_MS : -1);
+        if (nEvents < 0 && errno != EINTR)
+            break;
+
+        int e, wrote = 0;
+        for (e = 0; e < nEvents && !quit; ++e) {
+            Conn *c = events[e].data.ptr;
+
+            // new connections
+            if (!c) {
+                int fd;
+                while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    c = calloc(1, sizeof(Conn));
+                    c->fd = fd;
+                    c->next = conns;
+                    if (conns)
+                        conns->prev = c;
+                    conns = c;
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = c;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+                }
+                continue;
+            }
+
+            if (events[e].events & (EPOLLERR | EPOLLHUP))
+                c->eof = 1;
+            if (events[e].events & EPOLLIN) {
+                while (1) {
+                    if (c->inCap - c->inLen < READ_CHUNK) {
+                        c->inCap = c->inLen + 2 * READ_CHUNK;
+                        c->in = realloc(c->in, c->inCap);
+                    }
+                    ssize_t r = read(c->fd, c->in + c->inLen, READ_CHUNK);
+                    if (r > 0) {
+                        c->inLen += r;
+                        continue;
+                    }
+                    if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                        c->eof = 1;
+                    break;
+                }
+                quit = handleInput(c, rootPtr, pool, &wrote);
+            }
+
+            // replies for everything read so far, in one write
+            int flushed = flushOutput(c);
+            if (flushed < 0 || (c->eof && flushed))
+                closeConn(epfd, c, &conns);
+            else {
+                // while replies are backed up only wait for the socket to
+                // drain: reading on would let "out" grow without bound
+                ev.events = !flushed ? EPOLLOUT : c->eof ? 0 : EPOLLIN;
+                ev.data.ptr = c;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+            }
+        }
+        if (compactor && wrote)
+            compactRearm(compactor);
+        if (compactor && !compactor->settled && !quit)
+            compactStep(compactor, rootPtr, COMPACT_SLICE);
+    }
+
+    while (conns)
+        closeConn(epfd, conns, &conns);
+    close(epfd);
+    close(lfd);
+    unlink(socketPath);
+    return 0;
+}
+
+#endif
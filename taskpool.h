@@ -0,0 +1,248 @@
+
+/*
+ * Work-stealing task pool used by the parallel tree traversals
+ */
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * TASK POOL INFO:
+ * ----------------
+ * - Every worker owns a deque of tasks.
+ * - Workers pop their own deque from the tail (LIFO) and, when empty,
+ *   steal from the head (FIFO) of the other workers' deques.
+ * - Tasks submitted from a worker go to its own deque. Tasks submitted
+ *   from outside the pool are spread round-robin.
+ * - "poolWait" blocks until every submitted task has finished.
+ */
+
+typedef void (*TaskFn)(void *arg);
+
+struct taskClass {
+    TaskFn fn;
+    void *arg;
+};
+
+struct dequeClass {
+    /*ring buffer of tasks*/
+    struct taskClass *tasks;
+    int head, size, cap;
+    pthread_mutex_t lock;
+};
+
+struct poolClass {
+    int nThreads;
+    pthread_t *threads;
+    struct dequeClass *deques;
+    struct workerClass *workers;
+    /*protects the counters below and both condition variables*/
+    pthread_mutex_t lock;
+    pthread_cond_t workCond, doneCond;
+    /*tasks sitting in deques / tasks not finished yet*/
+    int queued, pending;
+    int nextDeque, shutdown;
+};
+
+/*arguments handed to every worker thread*/
+struct workerClass {
+    struct poolClass *pool;
+    int id;
+};
+
+/*definitions to resemble types/classes*/
+typedef struct taskClass Task;
+typedef struct workerClass Worker;
+typedef struct dequeClass Deque;
+typedef struct poolClass * PoolPtr;
+typedef struct poolClass Pool;
+
+/**************** Prototypes ****************/
+
+PoolPtr createPool(int nThreads);
+void poolSubmit(PoolPtr pool, TaskFn fn, void *arg);
+void poolWait(PoolPtr pool);
+void freePool(PoolPtr pool);
+int defaultThreads(void);
+
+/*worker index of the calling thread (-1 outside of the pool)*/
+static __thread int workerId = -1;
+
+/***************************************************************/
+/************************** FUNCTIONS **************************/
+/***************************************************************/
+
+void dequePush(Deque *d, Task t) {
+/** Push a task at the tail of the deque, growing it if needed.*/
+    pthread_mutex_lock(&d->lock);
+    if (d->size == d->cap) {
+        int cap = d->cap ? d->cap * 2 : 64;
+        Task *tasks = calloc(cap, sizeof(Task));
+        int i;
+        for (i = 0; i < d->size; ++i)
+            tasks[i] = d->tasks[(d->head + i) % d->cap];
+        free(d->tasks);
+        d->tasks = tasks;
+        d->head = 0;
+        d->cap = cap;
+    }
+    d->tasks[(d->head + d->size) % d->cap] = t;
+    ++d->size;
+    pthread_mutex_unlock(&d->lock);
+}
+
+int dequePop(Deque *d, Task *t, int fromTail) {
+/** Take a task from the tail (owner) or the head (thief) of the deque.
+  * Returns: 1 if a task was taken, 0 if the deque was empty.
+  */
+    int taken = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->size > 0) {
+        if (fromTail)
+            *t = d->tasks[(d->head + d->size - 1) % d->cap];
+        else {
+            *t = d->tasks[d->head];
+            d->head = (d->head + 1) % d->cap;
+        }
+        --d->size;
+        taken = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return taken;
+}
+
+int takeTask(PoolPtr pool, int id, Task *t) {
+/** Pop from own deque first, then try to steal from the others.*/
+    if (dequePop(&pool->deques[id], t, 1))
+        return 1;
+
+    int i;
+    for (i = 1; i < pool->nThreads; ++i) {
+        if (dequePop(&pool->deques[(id + i) % pool->nThreads], t, 0))
+            return 1;
+    }
+    return 0;
+}
+
+void *workerLoop(void *arg) {
+/** Body of every worker thread: run tasks until the pool shuts down.*/
+    PoolPtr pool = ((Worker *)arg)->pool;
+    workerId = ((Worker *)arg)->id;
+
+    Task t;
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->queued && !pool->shutdown)
+            pthread_cond_wait(&pool->workCond, &pool->lock);
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        /*reserve one queued task: it is already in some deque*/
+        --pool->queued;
+        pthread_mutex_unlock(&pool->lock);
+
+        while (!takeTask(pool, workerId, &t))
+            ;
+        t.fn(t.arg);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_broadcast(&pool->doneCond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+PoolPtr createPool(int nThreads) {
+/** Creates a pool with "nThreads" workers (at least 1).*/
+    if (nThreads < 1)
+        nThreads = 1;
+
+    PoolPtr pool = calloc(1, sizeof(Pool));
+    pool->nThreads = nThreads;
+    pool->threads = calloc(nThreads, sizeof(pthread_t));
+    pool->deques = calloc(nThreads, sizeof(Deque));
+    pool->workers = calloc(nThreads, sizeof(Worker));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->workCond, NULL);
+    pthread_cond_init(&pool->doneCond, NULL);
+
+    int i;
+    for (i = 0; i < nThreads; ++i)
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    for (i = 0; i < nThreads; ++i) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        pthread_create(&pool->threads[i], NULL, workerLoop, &pool->workers[i]);
+    }
+    return pool;
+}
+
+void poolSubmit(PoolPtr pool, TaskFn fn, void *arg) {
+/** Queue a task. Safe to call from inside a running task.*/
+    Task t = { fn, arg };
+    int id;
+
+    pthread_mutex_lock(&pool->lock);
+    ++pool->pending;
+    if (workerId >= 0)
+        id = workerId;
+    else
+        id = pool->nextDeque++ % pool->nThreads;
+    pthread_mutex_unlock(&pool->lock);
+
+    dequePush(&pool->deques[id], t);
+
+    pthread_mutex_lock(&pool->lock);
+    ++pool->queued;
+    pthread_cond_signal(&pool->workCond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void poolWait(PoolPtr pool) {
+/** Block until all submitted tasks are finished.
+  * Must be called from outside the pool.
+  */
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending)
+        pthread_cond_wait(&pool->doneCond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void freePool(PoolPtr pool) {
+/** Stop the workers and free all memory of the pool.*/
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->workCond);
+    pthread_mutex_unlock(&pool->lock);
+
+    int i;
+    for (i = 0; i < pool->nThreads; ++i)
+        pthread_join(pool->threads[i], NULL);
+    for (i = 0; i < pool->nThreads; ++i) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->workCond);
+    pthread_cond_destroy(&pool->doneCond);
+    free(pool->deques);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+}
+
+int defaultThreads(void) {
+/** Number of online cores.*/
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+}
+
+#endif